@@ -110,12 +110,15 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * One page of an address space, or all of it if ts_vaddr is
+	 * TLBSHOOTDOWN_ASALL (which is never page-aligned).
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
 };
 
+#define TLBSHOOTDOWN_ASALL ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
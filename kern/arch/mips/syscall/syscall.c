@@ -38,6 +38,7 @@
 
 #include <file_syscalls.h>
 #include <process_syscalls.h>
+#include <vm_syscalls.h>
 #include <copyinout.h>
 
 /*
@@ -84,6 +85,7 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	off_t offset, retval_offset;
+	int fd;
 	int err=0;
 	int *error = &err;
 
@@ -127,12 +129,36 @@ syscall(struct trapframe *tf)
 	    case SYS_close:
 	    	err = close(tf->tf_a0);
 	    	break;
+	    case SYS_pipe:
+	    	err = pipe((userptr_t)tf->tf_a0);
+	    	break;
 	    case SYS_read:
 	    	retval = read(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, error);
 	    	break;
 	    case SYS_write:
 	    	retval = write(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, error);
 	    	break;
+	    case SYS_pread:
+	    	// a0: fd, a1: buf, a2: size, sp+16: offset (64-bit, so aligned)
+	    	err = copyin((const_userptr_t)(tf->tf_sp+16), &offset, sizeof(off_t));
+	    	if (err) {
+	    		break;
+	    	}
+	    	retval = pread(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, offset, error);
+	    	break;
+	    case SYS_pwrite:
+	    	err = copyin((const_userptr_t)(tf->tf_sp+16), &offset, sizeof(off_t));
+	    	if (err) {
+	    		break;
+	    	}
+	    	retval = pwrite(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2, offset, error);
+	    	break;
+	    case SYS_readv:
+	    	retval = readv(tf->tf_a0, (const struct iovec *)tf->tf_a1, tf->tf_a2, error);
+	    	break;
+	    case SYS_writev:
+	    	retval = writev(tf->tf_a0, (const struct iovec *)tf->tf_a1, tf->tf_a2, error);
+	    	break;
 	    case SYS_lseek:
 	    	// 32 to 64bit
 	    	offset = (off_t) (tf->tf_a2)<<32 | tf->tf_a3;
@@ -168,6 +194,9 @@ syscall(struct trapframe *tf)
 	    case SYS_fork:
 	    	retval = fork(tf, error);
 	    	break;
+	    case SYS_vfork:
+	    	retval = vfork(tf, error);
+	    	break;
 	    case SYS_waitpid:
 	    	retval = waitpid(tf->tf_a0, (int*)tf->tf_a1, tf->tf_a2, error);
 	    	break;
@@ -181,6 +210,27 @@ syscall(struct trapframe *tf)
 	    	retval = sbrk(tf->tf_a0, error);
 	    	break;
 
+	    case SYS_mmap:
+	    	// a0: addr, a1: len, a2: prot, a3: flags
+	    	// sp+16: fd, sp+24: offset (64-bit, so aligned)
+	    	err = copyin((const_userptr_t)(tf->tf_sp+16), &fd, sizeof(int));
+	    	if (err) {
+	    		break;
+	    	}
+	    	err = copyin((const_userptr_t)(tf->tf_sp+24), &offset, sizeof(off_t));
+	    	if (err) {
+	    		break;
+	    	}
+	    	retval = mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3,
+	    			fd, offset, error);
+	    	break;
+	    case SYS_munmap:
+	    	err = munmap(tf->tf_a0, tf->tf_a1);
+	    	break;
+	    case SYS_mprotect:
+	    	err = mprotect(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+	    	break;
+
 	    //--------------------------------------------------
 
 	    default:
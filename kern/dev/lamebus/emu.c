@@ -261,16 +261,30 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 
 /*
  * Common code for read and readdir.
+ *
+ * A user buffer is copied out only after e_lock is dropped, through a
+ * bounce buffer: touching it can fault, and the fault can read a
+ * mapped file from this same device.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce = NULL;
+	uint32_t amt;
+	off_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -279,15 +293,29 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
+		lock_release(sc->e_lock);
 		goto out;
 	}
-	
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	amt = emu_rreg(sc, REG_IOLEN);
+	offset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, amt, uio);
+		lock_release(sc->e_lock);
+	}
+	else {
+		KASSERT(amt <= len);
+		memcpy(bounce, sc->e_iobuf, amt);
+		lock_release(sc->e_lock);
+		result = uiomove(bounce, amt, uio);
+	}
+
+	uio->uio_offset = offset;
 
  out:
-	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -321,19 +349,39 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce = NULL;
+	off_t offset = uio->uio_offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
 
+	/* As in emu_doread, copy a user buffer in without e_lock. */
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	if (result) {
-		goto out;
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
+	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
@@ -341,6 +389,9 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -842,8 +893,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* Pages are read on demand through emufs_read. */
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
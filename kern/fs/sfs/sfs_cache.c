@@ -0,0 +1,493 @@
+/*
+ * sfs_cache.c
+ *
+ *  Buffer cache for SFS. Buffers are keyed by (device, block), found
+ *  through a hash table, and recycled in LRU order. Writes are held
+ *  in dirty buffers until eviction, sfs_bsync, or sfs_bwriteback from
+ *  the writeback thread. Dirty neighbours on disk go out together.
+ *
+ *  All of SFS runs under vfs_biglock, and so does this; a buffer only
+ *  needs to be pinned (b_refcount) across calls that might recycle it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+
+#define SFS_CACHE_NBUFS		(SFS_CACHE_SIZE / SFS_BLOCKSIZE)
+#define SFS_CACHE_HASHSIZE	64	/* power of two */
+
+/*
+ * Writeback policy: a dirty buffer is written once it is SFS_WB_AGE
+ * seconds old, or straight away once SFS_WB_HIWAT buffers are dirty.
+ */
+#define SFS_WB_AGE		5
+#define SFS_WB_HIWAT		(SFS_CACHE_NBUFS / 2)
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* owner, for I/O */
+	struct device *b_dev;		/* key; NULL if the buffer is free */
+	uint32_t b_block;		/* key */
+	bool b_dirty;
+	time_t b_dirtytime;		/* when it last went from clean */
+	unsigned b_refcount;		/* pins */
+	struct sfs_buf *b_hashnext;
+	struct sfs_buf *b_lruprev;	/* toward most recently used */
+	struct sfs_buf *b_lrunext;
+	char *b_data;
+};
+
+static struct sfs_buf *sfs_bufs = NULL;
+static char *sfs_bufdata = NULL;
+static struct sfs_buf *sfs_bufhash[SFS_CACHE_HASHSIZE];
+static unsigned sfs_ndirty = 0;
+
+/* LRU list of all buffers; free buffers sit at the tail. */
+static struct sfs_buf *sfs_lruhead = NULL;
+static struct sfs_buf *sfs_lrutail = NULL;
+
+
+static
+unsigned
+sfs_bhash(struct device *dev, uint32_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) & (SFS_CACHE_HASHSIZE - 1);
+}
+
+static
+void
+sfs_lru_remove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		sfs_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		sfs_lrutail = buf->b_lruprev;
+	}
+	buf->b_lruprev = buf->b_lrunext = NULL;
+}
+
+static
+void
+sfs_lru_addhead(struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = buf;
+	}
+	else {
+		sfs_lrutail = buf;
+	}
+	sfs_lruhead = buf;
+}
+
+static
+void
+sfs_lru_addtail(struct sfs_buf *buf)
+{
+	buf->b_lrunext = NULL;
+	buf->b_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = buf;
+	}
+	else {
+		sfs_lruhead = buf;
+	}
+	sfs_lrutail = buf;
+}
+
+static
+void
+sfs_hash_remove(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_bufhash[sfs_bhash(buf->b_dev, buf->b_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = buf->b_hashnext;
+	buf->b_hashnext = NULL;
+}
+
+static
+struct sfs_buf *
+sfs_blookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	buf = sfs_bufhash[sfs_bhash(sfs->sfs_device, block)];
+	for (; buf != NULL; buf = buf->b_hashnext) {
+		if (buf->b_dev == sfs->sfs_device && buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write a dirty buffer to disk, along with any dirty buffers for the
+ * blocks on either side of it, up to SFS_IORUN blocks in one request.
+ */
+static
+int
+sfs_bwrite(struct sfs_buf *buf)
+{
+	struct iovec iov[SFS_IORUN];
+	struct sfs_buf *run[SFS_IORUN];
+	struct sfs_fs *sfs = buf->b_fs;
+	struct sfs_buf *prev;
+	struct uio ku;
+	unsigned i, n;
+	int result;
+
+	KASSERT(buf->b_dirty);
+
+	/* Back up to the start of the run. */
+	for (n = 1; n < SFS_IORUN && buf->b_block > 0; n++) {
+		prev = sfs_blookup(sfs, buf->b_block - 1);
+		if (prev == NULL || !prev->b_dirty) {
+			break;
+		}
+		buf = prev;
+	}
+
+	n = 0;
+	do {
+		run[n] = buf;
+		iov[n].iov_kbase = buf->b_data;
+		iov[n].iov_len = SFS_BLOCKSIZE;
+		n++;
+		buf = sfs_blookup(sfs, buf->b_block + 1);
+	} while (n < SFS_IORUN && buf != NULL && buf->b_dirty);
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)run[0]->b_block * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+
+	result = sfs_rwblock(sfs, &ku);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<n; i++) {
+		run[i]->b_dirty = false;
+	}
+	KASSERT(sfs_ndirty >= n);
+	sfs_ndirty -= n;
+	return 0;
+}
+
+/*
+ * Drop BUF's identity and move it to the LRU tail for reuse.
+ */
+static
+void
+sfs_binvalidate(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_refcount == 0);
+
+	if (buf->b_dev != NULL) {
+		sfs_hash_remove(buf);
+	}
+	if (buf->b_dirty) {
+		KASSERT(sfs_ndirty > 0);
+		sfs_ndirty--;
+	}
+	buf->b_fs = NULL;
+	buf->b_dev = NULL;
+	buf->b_dirty = false;
+	sfs_lru_remove(buf);
+	sfs_lru_addtail(buf);
+}
+
+/*
+ * Find a buffer for (SFS, BLOCK), pinned. *HIT says whether it already
+ * held the block; if not, its contents are garbage.
+ */
+static
+int
+sfs_bfind(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret,
+	  bool *hit)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sfs_bufs != NULL);
+
+	buf = sfs_blookup(sfs, block);
+	if (buf != NULL) {
+		*hit = true;
+	}
+	else {
+		*hit = false;
+
+		/* Take the least recently used buffer nobody has pinned. */
+		for (buf = sfs_lrutail; buf != NULL; buf = buf->b_lruprev) {
+			if (buf->b_refcount == 0) {
+				break;
+			}
+		}
+		if (buf == NULL) {
+			panic("sfs: all %d cache buffers pinned\n",
+			      SFS_CACHE_NBUFS);
+		}
+
+		if (buf->b_dirty) {
+			result = sfs_bwrite(buf);
+			if (result) {
+				return result;
+			}
+		}
+		if (buf->b_dev != NULL) {
+			sfs_hash_remove(buf);
+		}
+
+		buf->b_fs = sfs;
+		buf->b_dev = sfs->sfs_device;
+		buf->b_block = block;
+		buf->b_hashnext = sfs_bufhash[sfs_bhash(buf->b_dev, block)];
+		sfs_bufhash[sfs_bhash(buf->b_dev, block)] = buf;
+	}
+
+	buf->b_refcount++;
+	sfs_lru_remove(buf);
+	sfs_lru_addhead(buf);
+	*ret = buf;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Allocate the buffers. Called on each mount; only the first does
+ * anything.
+ */
+int
+sfs_cache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_bufs != NULL) {
+		return 0;
+	}
+
+	sfs_bufs = kmalloc(SFS_CACHE_NBUFS * sizeof(struct sfs_buf));
+	if (sfs_bufs == NULL) {
+		return ENOMEM;
+	}
+	sfs_bufdata = kmalloc(SFS_CACHE_NBUFS * SFS_BLOCKSIZE);
+	if (sfs_bufdata == NULL) {
+		kfree(sfs_bufs);
+		sfs_bufs = NULL;
+		return ENOMEM;
+	}
+
+	for (int i=0; i<SFS_CACHE_HASHSIZE; i++) {
+		sfs_bufhash[i] = NULL;
+	}
+	for (int i=0; i<SFS_CACHE_NBUFS; i++) {
+		struct sfs_buf *buf = &sfs_bufs[i];
+
+		buf->b_fs = NULL;
+		buf->b_dev = NULL;
+		buf->b_block = 0;
+		buf->b_dirty = false;
+		buf->b_dirtytime = 0;
+		buf->b_refcount = 0;
+		buf->b_hashnext = NULL;
+		buf->b_data = sfs_bufdata + i * SFS_BLOCKSIZE;
+		sfs_lru_addtail(buf);
+	}
+	return 0;
+}
+
+/*
+ * Get BLOCK, reading it from disk if it is not cached.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	struct iovec iov;
+	struct uio ku;
+	bool hit;
+	int result;
+
+	result = sfs_bfind(sfs, block, &buf, &hit);
+	if (result) {
+		return result;
+	}
+	if (!hit) {
+		SFSUIO(&iov, &ku, buf->b_data, block, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
+		if (result) {
+			buf->b_refcount--;
+			sfs_binvalidate(buf);
+			return result;
+		}
+	}
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Get a buffer for BLOCK without reading it. The caller is going to
+ * overwrite all of it, so unless it was cached its contents are junk.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	bool hit;
+
+	return sfs_bfind(sfs, block, ret, &hit);
+}
+
+void *
+sfs_bdata(struct sfs_buf *buf)
+{
+	return buf->b_data;
+}
+
+void
+sfs_bdirty(struct sfs_buf *buf)
+{
+	uint32_t nsecs;
+
+	KASSERT(buf->b_refcount > 0);
+	if (!buf->b_dirty) {
+		buf->b_dirty = true;
+		gettime(&buf->b_dirtytime, &nsecs);
+		sfs_ndirty++;
+	}
+}
+
+void
+sfs_brelse(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_refcount > 0);
+	buf->b_refcount--;
+}
+
+bool
+sfs_bcached(struct sfs_fs *sfs, uint32_t block)
+{
+	return sfs_blookup(sfs, block) != NULL;
+}
+
+/*
+ * Discard any cached copy of BLOCK, dirty or not. For blocks that
+ * have been freed or are about to be overwritten on disk directly.
+ */
+void
+sfs_bforget(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	buf = sfs_blookup(sfs, block);
+	if (buf != NULL) {
+		sfs_binvalidate(buf);
+	}
+}
+
+/*
+ * Write out every dirty buffer belonging to SFS.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (int i=0; i<SFS_CACHE_NBUFS; i++) {
+		struct sfs_buf *buf = &sfs_bufs[i];
+
+		if (buf->b_dev == sfs->sfs_device && buf->b_dirty) {
+			result = sfs_bwrite(buf);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write out dirty buffers, of any volume, that are old enough, or all
+ * of them if too many are dirty. Called periodically by the writeback
+ * thread. Returns the first error; the buffer involved stays dirty.
+ */
+int
+sfs_bwriteback(void)
+{
+	time_t now;
+	uint32_t nsecs;
+	bool all;
+	int result, ret = 0;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_bufs == NULL || sfs_ndirty == 0) {
+		return 0;
+	}
+
+	gettime(&now, &nsecs);
+	all = sfs_ndirty >= SFS_WB_HIWAT;
+
+	for (int i=0; i<SFS_CACHE_NBUFS; i++) {
+		struct sfs_buf *buf = &sfs_bufs[i];
+
+		if (!buf->b_dirty) {
+			continue;
+		}
+		if (!all && now - buf->b_dirtytime < SFS_WB_AGE) {
+			continue;
+		}
+		result = sfs_bwrite(buf);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Drop every buffer belonging to SFS, at unmount. They must all have
+ * been synced.
+ */
+void
+sfs_bpurge(struct sfs_fs *sfs)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (int i=0; i<SFS_CACHE_NBUFS; i++) {
+		struct sfs_buf *buf = &sfs_bufs[i];
+
+		if (buf->b_dev == sfs->sfs_device) {
+			KASSERT(!buf->b_dirty);
+			sfs_binvalidate(buf);
+		}
+	}
+}
@@ -0,0 +1,252 @@
+/*
+ * sfs_dcache.c
+ *
+ *  Name lookup cache for SFS. Entries map (volume, directory inode,
+ *  name) to the inode and slot the name was found at, or record that
+ *  the name is not there (ino SFS_NOINO), so sfs_dir_findname can skip
+ *  reading the directory. Entries are recycled in LRU order.
+ *
+ *  sfs_dir_link and sfs_dir_unlink, through which every directory
+ *  change goes, keep the cache up to date by calling sfs_dcache_enter.
+ *  Like the rest of SFS this runs under vfs_biglock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vfs.h>
+#include <sfs.h>
+
+#define SFS_DCACHE_NENTRIES	128
+#define SFS_DCACHE_HASHSIZE	64	/* power of two */
+
+struct sfs_dcent {
+	struct sfs_fs *de_fs;		/* key; NULL if the entry is free */
+	uint32_t de_dirino;		/* key */
+	char de_name[SFS_NAMELEN];	/* key */
+	uint32_t de_ino;		/* SFS_NOINO if the name is absent */
+	int de_slot;			/* where it is, if present */
+	struct sfs_dcent *de_hashnext;
+	struct sfs_dcent *de_lruprev;	/* toward most recently used */
+	struct sfs_dcent *de_lrunext;
+};
+
+static struct sfs_dcent sfs_dcents[SFS_DCACHE_NENTRIES];
+static struct sfs_dcent *sfs_dchash[SFS_DCACHE_HASHSIZE];
+static bool sfs_dcache_ready = false;
+
+/* LRU list of all entries; free entries sit at the tail. */
+static struct sfs_dcent *sfs_dclruhead = NULL;
+static struct sfs_dcent *sfs_dclrutail = NULL;
+
+
+static
+unsigned
+sfs_dchashfn(struct sfs_fs *sfs, uint32_t dirino, const char *name)
+{
+	unsigned h = dirino ^ ((uintptr_t)sfs >> 4);
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h & (SFS_DCACHE_HASHSIZE - 1);
+}
+
+static
+void
+sfs_dclru_remove(struct sfs_dcent *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		sfs_dclruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		sfs_dclrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+sfs_dclru_addhead(struct sfs_dcent *de)
+{
+	de->de_lruprev = NULL;
+	de->de_lrunext = sfs_dclruhead;
+	if (sfs_dclruhead != NULL) {
+		sfs_dclruhead->de_lruprev = de;
+	}
+	else {
+		sfs_dclrutail = de;
+	}
+	sfs_dclruhead = de;
+}
+
+static
+void
+sfs_dclru_addtail(struct sfs_dcent *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = sfs_dclrutail;
+	if (sfs_dclrutail != NULL) {
+		sfs_dclrutail->de_lrunext = de;
+	}
+	else {
+		sfs_dclruhead = de;
+	}
+	sfs_dclrutail = de;
+}
+
+/*
+ * Drop an entry and move it to the free end of the LRU list.
+ */
+static
+void
+sfs_dcache_drop(struct sfs_dcent *de)
+{
+	struct sfs_dcent **pp;
+
+	KASSERT(de->de_fs != NULL);
+
+	pp = &sfs_dchash[sfs_dchashfn(de->de_fs, de->de_dirino, de->de_name)];
+	while (*pp != de) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->de_hashnext;
+	}
+	*pp = de->de_hashnext;
+	de->de_hashnext = NULL;
+	de->de_fs = NULL;
+
+	sfs_dclru_remove(de);
+	sfs_dclru_addtail(de);
+}
+
+static
+struct sfs_dcent *
+sfs_dcache_find(struct sfs_fs *sfs, uint32_t dirino, const char *name)
+{
+	struct sfs_dcent *de;
+
+	de = sfs_dchash[sfs_dchashfn(sfs, dirino, name)];
+	for (; de != NULL; de = de->de_hashnext) {
+		if (de->de_fs == sfs && de->de_dirino == dirino &&
+		    !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Set up the entries. Called on each mount; only the first does
+ * anything.
+ */
+void
+sfs_dcache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_dcache_ready) {
+		return;
+	}
+
+	for (int i=0; i<SFS_DCACHE_HASHSIZE; i++) {
+		sfs_dchash[i] = NULL;
+	}
+	for (int i=0; i<SFS_DCACHE_NENTRIES; i++) {
+		struct sfs_dcent *de = &sfs_dcents[i];
+
+		de->de_fs = NULL;
+		de->de_hashnext = NULL;
+		sfs_dclru_addtail(de);
+	}
+	sfs_dcache_ready = true;
+}
+
+/*
+ * Look NAME up in directory DIRINO. Returns false if the cache doesn't
+ * know; otherwise *INO is the inode, or SFS_NOINO if NAME is known not
+ * to exist, and *SLOT (if not NULL) is its directory slot.
+ */
+bool
+sfs_dcache_lookup(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		  uint32_t *ino, int *slot)
+{
+	struct sfs_dcent *de;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	de = sfs_dcache_find(sfs, dirino, name);
+	if (de == NULL) {
+		return false;
+	}
+
+	sfs_dclru_remove(de);
+	sfs_dclru_addhead(de);
+
+	*ino = de->de_ino;
+	if (slot != NULL) {
+		*slot = de->de_slot;
+	}
+	return true;
+}
+
+/*
+ * Record that NAME in directory DIRINO is inode INO at SLOT, or with
+ * INO SFS_NOINO that it does not exist. Replaces whatever was cached.
+ */
+void
+sfs_dcache_enter(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		 uint32_t ino, int slot)
+{
+	struct sfs_dcent *de;
+	unsigned h;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(name) >= SFS_NAMELEN) {
+		/* Can't be in a directory, and doesn't fit here */
+		return;
+	}
+
+	de = sfs_dcache_find(sfs, dirino, name);
+	if (de == NULL) {
+		de = sfs_dclrutail;
+		if (de->de_fs != NULL) {
+			sfs_dcache_drop(de);
+		}
+		de->de_fs = sfs;
+		de->de_dirino = dirino;
+		strcpy(de->de_name, name);
+
+		h = sfs_dchashfn(sfs, dirino, name);
+		de->de_hashnext = sfs_dchash[h];
+		sfs_dchash[h] = de;
+	}
+	de->de_ino = ino;
+	de->de_slot = slot;
+
+	sfs_dclru_remove(de);
+	sfs_dclru_addhead(de);
+}
+
+/*
+ * Drop every entry belonging to SFS, at unmount.
+ */
+void
+sfs_dcache_purge(struct sfs_fs *sfs)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_dcache_ready) {
+		return;
+	}
+	for (int i=0; i<SFS_DCACHE_NENTRIES; i++) {
+		if (sfs_dcents[i].de_fs == sfs) {
+			sfs_dcache_drop(&sfs_dcents[i]);
+		}
+	}
+}
@@ -39,6 +39,8 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <clock.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -47,6 +49,10 @@
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
 
+/* Mounted volumes, for the writeback thread. Protected by vfs_biglock. */
+static struct sfs_fs *sfs_wblist = NULL;
+static bool sfs_wbstarted = false;
+
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
  * We always do the whole bitmap at once; writing individual sectors
@@ -101,6 +107,86 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Copy dirty inodes, the free block map and the superblock into the
+ * buffer cache. Nothing is written to disk unless buffers get recycled.
+ */
+static
+int
+sfs_syncmeta(struct sfs_fs *sfs)
+{
+	unsigned i, num;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* Go over the array of loaded vnodes, syncing as we go. */
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+		result = sfs_sync_inode(v->vn_data);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* If the free block map needs to be written, write it. */
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	return 0;
+}
+
+/*
+ * Writeback thread. Once a second, copy the metadata of every mounted
+ * volume into the buffer cache and let the cache write out whatever is
+ * old enough (see sfs_bwriteback). This keeps metadata writes out of
+ * the system calls that make them; sync still writes everything.
+ */
+static
+void
+sfs_writeback_thread(void *junk1, unsigned long junk2)
+{
+	struct sfs_fs *sfs;
+	int result;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(1);
+
+		vfs_biglock_acquire();
+		for (sfs = sfs_wblist; sfs != NULL; sfs = sfs->sfs_wbnext) {
+			result = sfs_syncmeta(sfs);
+			if (result) {
+				kprintf("sfs: %s: writeback: %s\n",
+					sfs->sfs_super.sp_volname,
+					strerror(result));
+			}
+		}
+		result = sfs_bwriteback();
+		if (result) {
+			kprintf("sfs: writeback: %s\n", strerror(result));
+		}
+		vfs_biglock_release();
+	}
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,7 +197,6 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -148,31 +233,18 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	/* Inodes, free map and superblock go into the cache... */
+	result = sfs_syncmeta(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_superdirty = false;
+	/* ...and then everything goes out of the cache. */
+	result = sfs_bsync(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	vfs_biglock_release();
@@ -208,6 +280,7 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	struct sfs_fs **pp;
 
 	vfs_biglock_acquire();
 	
@@ -222,6 +295,12 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
+	for (pp = &sfs_wblist; *pp != sfs; pp = &(*pp)->sfs_wbnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sfs->sfs_wbnext;
+	sfs_bpurge(sfs);
+	sfs_dcache_purge(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
 	
@@ -282,6 +361,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	result = sfs_cache_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	sfs_dcache_init();
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -316,6 +402,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
+		sfs_bpurge(sfs);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
@@ -333,6 +420,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		sfs_bpurge(sfs);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
@@ -340,6 +428,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		sfs_bpurge(sfs);
 		bitmap_destroy(sfs->sfs_freemap);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
@@ -358,6 +447,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
 
+	/* Hand the volume to the writeback thread, starting it if need be */
+	sfs->sfs_wbnext = sfs_wblist;
+	sfs_wblist = sfs;
+	if (!sfs_wbstarted) {
+		result = thread_fork("sfs writeback", sfs_writeback_thread,
+				     NULL, 0, NULL);
+		if (result) {
+			kprintf("sfs: No writeback thread: %s\n",
+				strerror(result));
+		}
+		else {
+			sfs_wbstarted = true;
+		}
+	}
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
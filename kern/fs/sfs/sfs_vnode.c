@@ -53,18 +53,25 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block (in the buffer cache, written back later). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_bget(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_bdata(buf), SFS_BLOCKSIZE);
+	sfs_bdirty(buf);
+	sfs_brelse(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
-static
+/* Write an on-disk inode structure back out, to the buffer cache. */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
@@ -84,11 +91,12 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block. If CLEAR is false the caller must write the whole
+ * block before anything can read it.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock, bool clear)
 {
 	int result;
 
@@ -102,6 +110,10 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
+	if (!clear) {
+		return 0;
+	}
+
 	/* Clear block before returning it */
 	return sfs_clearblock(sfs, *diskblock);
 }
@@ -113,6 +125,8 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	/* Its contents are dead; don't write them back. */
+	sfs_bforget(sfs, diskblock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
 }
@@ -140,28 +154,25 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * A newly allocated data block is not cleared on disk; FRESH is set
+ * instead, and the caller must fill the whole block (or clear it)
+ * before returning.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+	 uint32_t *diskblock, bool *fresh)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	*fresh = false;
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,10 +187,11 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, &block, false);
 			if (result) {
 				return result;
 			}
+			*fresh = true;
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
@@ -234,9 +246,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
 		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * indirect block. sfs_balloc clears it in the cache,
+		 * so the read below will not go to disk.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs, &idblock, true);
 		if (result) {
 			return result;
 		}
@@ -246,39 +259,32 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/* Load the indirect block, usually from the buffer cache. */
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = sfs_bdata(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = iddata[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc(sfs, &block, false);
 		if (result) {
+			sfs_brelse(idbuf);
 			return result;
 		}
+		*fresh = true;
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* Remember the block we allocated; written back later */
+		iddata[idoff] = block;
+		sfs_bdirty(idbuf);
 	}
+	sfs_brelse(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -308,18 +314,12 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
+	char *iodata;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	bool fresh;
 	int result;
 	
 	/* Allocate missing blocks if and only if we're writing */
@@ -331,7 +331,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &fresh);
 	if (result) {
 		return result;
 	}
@@ -339,52 +339,79 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
+	}
+
+	if (fresh) {
+		/*
+		 * We just allocated the block and it holds nothing
+		 * yet. Start from zeros instead of reading it.
+		 */
+		result = sfs_bget(sfs, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		iodata = sfs_bdata(iobuf);
+		bzero(iodata, SFS_BLOCKSIZE);
+		sfs_bdirty(iobuf);
 	}
 	else {
 		/*
-		 * Read the block.
+		 * Read the block, usually from the buffer cache.
 		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
+		result = sfs_bread(sfs, diskblock, &iobuf);
 		if (result) {
 			return result;
 		}
+		iodata = sfs_bdata(iobuf);
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove(iodata+skipstart, len, uio);
 	if (result) {
+		if (fresh) {
+			bzero(iodata, SFS_BLOCKSIZE);
+		}
+		sfs_brelse(iobuf);
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer goes back to disk later.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(iobuf);
 	}
+	sfs_brelse(iobuf);
 
 	return 0;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of whole blocks, at most MAXBLOCKS of
+ * them. Blocks that are consecutive on disk go to the device in one
+ * request, straight between the uio and the disk with no copy through
+ * a kernel buffer. Returns after the first run; the caller loops.
+ *
+ * These transfers bypass the buffer cache: a read of a cached block
+ * is served from it, and a write discards any cached copies.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
+	struct sfs_buf *buf;
+	uint32_t diskblock, nextblock;
 	uint32_t fileblock;
+	uint32_t nblocks;
+	uint32_t freshmask;
+	bool fresh;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
 	off_t saveoff;
@@ -392,11 +419,13 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	off_t saveres;
 	off_t diskres;
 
+	KASSERT(maxblocks > 0);
+
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &fresh);
 	if (result) {
 		return result;
 	}
@@ -412,20 +441,70 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
+	if (uio->uio_rw == UIO_READ && sfs_bcached(sfs, diskblock)) {
+		result = sfs_bread(sfs, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+		sfs_brelse(buf);
+		return result;
+	}
+
+	/*
+	 * Extend the run while the following file blocks sit right
+	 * after it on disk. A fresh block that breaks the run will be
+	 * written by a later call, but clear it now in case that call
+	 * never comes.
+	 */
+	if (maxblocks > SFS_IORUN) {
+		maxblocks = SFS_IORUN;
+	}
+	freshmask = fresh ? 1 : 0;
+	for (nblocks = 1; nblocks < maxblocks; nblocks++) {
+		result = sfs_bmap(sv, fileblock + nblocks, doalloc,
+				  &nextblock, &fresh);
+		if (result) {
+			/* Leave the error for the next call to report. */
+			break;
+		}
+		if (nextblock != diskblock + nblocks) {
+			if (fresh) {
+				result = sfs_clearblock(sfs, nextblock);
+				if (result) {
+					return result;
+				}
+			}
+			break;
+		}
+		if (uio->uio_rw == UIO_READ && sfs_bcached(sfs, nextblock)) {
+			break;
+		}
+		if (fresh) {
+			freshmask |= 1U << nblocks;
+		}
+	}
+
+	if (uio->uio_rw == UIO_WRITE) {
+		for (uint32_t i=0; i<nblocks; i++) {
+			sfs_bforget(sfs, diskblock + i);
+		}
+	}
+
 	/*
 	 * Do the I/O directly to the uio region. Save the uio_offset,
 	 * and substitute one that makes sense to the device.
 	 */
 	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
+	diskoff = (off_t)diskblock * SFS_BLOCKSIZE;
 	uio->uio_offset = diskoff;
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Temporarily set the residue to the length of the run.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid >= nblocks * SFS_BLOCKSIZE);
 	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
+	diskres = nblocks * SFS_BLOCKSIZE;
 	uio->uio_resid = diskres;
 	
 	result = sfs_rwblock(sfs, uio);
@@ -437,6 +516,15 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
 	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
 
+	/* Don't leave stale data in fresh blocks we failed to fill. */
+	if (result && freshmask != 0) {
+		for (uint32_t i=0; i<nblocks; i++) {
+			if (freshmask & (1U << i)) {
+				sfs_clearblock(sfs, diskblock + i);
+			}
+		}
+	}
+
 	return result;
 }
 
@@ -448,7 +536,6 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -505,9 +592,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (uio->uio_resid >= SFS_BLOCKSIZE) {
+		result = sfs_blockio(sv, uio, uio->uio_resid / SFS_BLOCKSIZE);
 		if (result) {
 			goto out;
 		}
@@ -640,6 +726,9 @@ sfs_dir_nentries(struct sfs_vnode *sv)
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * The name cache answers unless an empty slot is wanted, which takes
+ * a scan; scans refill it.
  */
 
 static
@@ -647,11 +736,28 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	struct sfs_dir tsd;
+	uint32_t foundino = SFS_NOINO;
+	int foundslot = -1;
 	int found = 0;
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	if (emptyslot == NULL &&
+	    sfs_dcache_lookup(sfs, sv->sv_ino, name, &foundino, &foundslot)) {
+		if (foundino == SFS_NOINO) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = foundslot;
+		}
+		if (ino != NULL) {
+			*ino = foundino;
+		}
+		return 0;
+	}
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -675,6 +781,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				KASSERT(found==0);
 
 				found = 1;
+				foundslot = i;
+				foundino = tsd.sfd_ino;
 				if (slot != NULL) {
 					*slot = i;
 				}
@@ -685,6 +793,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
+	sfs_dcache_enter(sfs, sv->sv_ino, name, foundino, foundslot);
 	return found ? 0 : ENOENT;
 }
 
@@ -729,25 +838,40 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	sfs_dcache_enter(sv->sv_v.vn_fs->fs_data, sv->sv_ino, name, ino,
+			 emptyslot);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME is the name in
+ * that slot, for the name cache.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	sfs_dcache_enter(sv->sv_v.vn_fs->fs_data, sv->sv_ino, name,
+			 SFS_NOINO, -1);
+	return 0;
 }
 
 /*
@@ -801,7 +925,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, &ino, true);
 	if (result) {
 		return result;
 	}
@@ -1100,24 +1224,30 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	int result;
 
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		/* The cache doesn't know which file a block is in. */
+		result = sfs_bsync(sfs);
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Pages are read on demand through sfs_read, so any
+ * regular file can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -1127,17 +1257,10 @@ static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -1147,8 +1270,6 @@ sfs_truncate(struct vnode *v, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
 	vfs_biglock_acquire();
 
 	/*
@@ -1177,41 +1298,40 @@ sfs_truncate(struct vnode *v, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		result = sfs_bread(sfs, idblock, &idbuf);
 		if (result) {
 			vfs_biglock_release();
 			return result;
 		}
+		iddata = sfs_bdata(idbuf);
 		
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && iddata[j] != 0) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (iddata[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		if (iddirty) {
+			/* The indirect block is dirty; written back later */
+			sfs_bdirty(idbuf);
+		}
+		sfs_brelse(idbuf);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -1370,7 +1490,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	}
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
@@ -1434,7 +1554,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_dirty = true;
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1457,7 +1577,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
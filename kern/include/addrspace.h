@@ -36,6 +36,8 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -47,14 +49,73 @@ struct vnode;
  * You write this.
  */
 
-struct page_table_entry{
-	vaddr_t va;
-	paddr_t pa;
-	int physical_addr;
-	struct page_table_entry *next;
-};
+/*
+ * Two-level page table covering the 2GB MIPS user segment. The top 9
+ * bits of a user address index the directory and the next 10 index a
+ * second-level table, which is exactly one page and is only allocated
+ * once something in its 4MB range is touched. Entries are kept in
+ * TLBLO format (frame | TLBLO_DIRTY | TLBLO_VALID) so they can be
+ * written to the TLB as-is.
+ */
+#define PT_DIR_SIZE        512
+#define PT_TABLE_SIZE      1024
+#define PT_DIR_INDEX(va)   (((va) >> 22) & (PT_DIR_SIZE - 1))
+#define PT_TABLE_INDEX(va) (((va) >> 12) & (PT_TABLE_SIZE - 1))
+
+/*
+ * Software bits in the low byte of a page table entry, which the TLB
+ * does not use. They are masked off before an entry is loaded.
+ *
+ * PTE_COW marks a page shared with another address space after fork;
+ * TLBLO_DIRTY is clear and the first write makes a private copy.
+ *
+ * PTE_SWAPPED entries are not valid and hold a swap slot number where
+ * the frame would be. PTE_PAGING is set while the page is on its way
+ * to or from swap; anyone else touching the entry waits for it.
+ *
+ * PTE_NOACCESS keeps the TLB refill path from loading a page whose
+ * region was made inaccessible by mprotect, so the access goes
+ * through the permission checks in vm_fault. It survives swapping.
+ */
+#define PTE_COW            0x00000001
+#define PTE_SWAPPED        0x00000002
+#define PTE_PAGING         0x00000004
+#define PTE_NOACCESS       0x00000008
+#define PTE_SWMASK         0x000000ff
+
+#define PTE_SLOT(pte)      ((unsigned)(pte) >> 12)
+#define PTE_MKSWAP(slot)   (((uint32_t)(slot) << 12) | PTE_SWAPPED)
 
 
+/*
+ * A region is a run of pages, either an ELF segment defined by
+ * as_define_region or a mapping made by mmap. REGION_LOADING makes a
+ * region writable between as_prepare_load and as_complete_load,
+ * whatever its permissions. The permission bits match PROT_*.
+ *
+ * Pages of a file mapping are read from rg_vnode the first time they
+ * are touched and are private to the address space from then on;
+ * everything else starts out zero-filled.
+ */
+#define REGION_READ        0x1
+#define REGION_WRITE       0x2
+#define REGION_EXEC        0x4
+#define REGION_LOADING     0x8
+#define REGION_SHARED      0x10 /* MAP_SHARED; can't be made writable */
+
+#define RG_SEGMENT         0    /* ELF segment */
+#define RG_ANON            1    /* anonymous mmap */
+#define RG_FILE            2    /* file mmap */
+
+struct region {
+        vaddr_t rg_vbase;
+        size_t rg_npages;
+        int rg_flags;
+        int rg_type;
+        struct vnode *rg_vnode;  /* RG_FILE: the file, referenced */
+        off_t rg_offset;         /* RG_FILE: file offset of rg_vbase */
+};
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -66,19 +127,27 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        struct page_table_entry *pte;
+        uint32_t *pt_dir[PT_DIR_SIZE];
 
-        vaddr_t as_vbase1;
-        size_t as_npages1;
-
-        vaddr_t as_vbase2;
-        size_t as_npages2;
+        /* Regions, sorted by base address and not overlapping */
+        struct region *as_regions;
+        unsigned as_nregions;
 
         vaddr_t as_stackvbase;
 
         vaddr_t hstart;
         vaddr_t hend;
 
+        /*
+         * TLB PID on each cpu, as generation * NUM_TLBPID + pid.
+         * Stale unless the generation is that cpu's current one.
+         * as_cpus has a bit set for each cpu that has this address
+         * space loaded (see c_tlbas) and may hold live entries for it.
+         */
+        struct spinlock as_tlblock;
+        uint32_t as_asid[MAXCPUS];
+        uint32_t as_cpus;
+
 #endif
 };
 
@@ -114,6 +183,24 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *
+ *    as_find_free - pick an address for an NPAGES mmap, working down
+ *                from the stack and staying clear of the heap.
+ *
+ *    as_range_free - true if no region overlaps the page range.
+ *
+ *    as_define_mmap - add a mapping of NPAGES at VADDR, which must be
+ *                free. VN is referenced for a file mapping.
+ *
+ *    as_unmap   - remove the mappings in a page range, freeing their
+ *                pages. Mappings are split as needed. EINVAL if the
+ *                range touches an ELF segment.
+ *
+ *    as_protect - set the permissions of the mapped pages in a range,
+ *                splitting mappings as needed. ENOMEM if any page in
+ *                the range is not mapped by mmap.
  */
 
 struct addrspace *as_create(void);
@@ -129,6 +216,37 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int               as_find_free(struct addrspace *as, size_t npages,
+                               vaddr_t *ret);
+bool              as_range_free(struct addrspace *as, vaddr_t vaddr,
+                                size_t npages);
+int               as_define_mmap(struct addrspace *as, vaddr_t vaddr,
+                                 size_t npages, int flags,
+                                 struct vnode *vn, off_t offset);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages);
+int               as_protect(struct addrspace *as, vaddr_t vaddr,
+                             size_t npages, int flags);
+
+
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_lookup  - return a pointer to the page table entry for VADDR,
+ *                 or NULL if there is none. If CREATE is set, the
+ *                 second-level table is allocated if necessary and
+ *                 NULL means out of memory.
+ *
+ *    pt_copy    - map every page of OLD into NEW as well, copy-on-write
+ *                 in both.
+ *
+ *    pt_destroy - free every mapped page and all second-level tables.
+ */
+
+uint32_t         *pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create);
+int               pt_copy(struct addrspace *old, struct addrspace *new);
+void              pt_destroy(struct addrspace *as);
 
 
 /*
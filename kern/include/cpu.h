@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Size of the per-cpu free page cache. */
+#define CPU_PAGECACHE_MAX 32
+
 
 /*
  * Per-cpu structure
@@ -61,6 +64,29 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Free pages kept back from the coremap (see vm.c).
+	 */
+	unsigned c_npagecache;
+	int c_pagecache[CPU_PAGECACHE_MAX];
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * TLB address space IDs (see vm_tlb_activate).
+	 */
+	struct addrspace *c_tlbas;	/* Address space whose PID is loaded */
+	uint32_t c_tlbpid;		/* PID loaded in the MMU */
+	uint32_t c_asidgen;		/* Current PID generation */
+	uint32_t c_nextasid;		/* Next PID to hand out */
+
+	/*
+	 * Written only by this cpu; read by others without locking.
+	 * Decaying average of threads wanting this cpu (queued plus
+	 * running), in units of 1/LOAD_SCALE (see thread.c).
+	 */
+	unsigned c_loadavg;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -82,10 +108,15 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each batch of shootdowns taken off c_shootdown is numbered;
+	 * c_shootdown_done is the last batch finished.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_taken;	/* Batches taken */
+	unsigned c_shootdown_done;	/* Batches finished */
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +183,12 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket; ipi_tlbshootdown_wait(target, ticket) waits
+ * until the target has carried out that shootdown.
+ * ipi_tlbshootdown_cpus does one shootdown on every CPU whose bit
+ * (1 << c_number) is set in CPUMASK, the current one included, and
+ * waits for all of them. Waiting needs interrupts on, so these must
+ * not be called with spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +202,11 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
+void ipi_tlbshootdown_cpus(uint32_t cpumask,
+			   const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
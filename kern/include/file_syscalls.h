@@ -8,23 +8,61 @@
 #ifndef FILE_SYSCALLS_H_
 #define FILE_SYSCALLS_H_
 
+#include <kern/limits.h>
+#include <spinlock.h>
 
+struct iovec;
+
+
+/*
+ * An open file. Every descriptor that refers to it, in this process
+ * or in others after dup2 and fork, shares the one fhandle, which is
+ * freed when ref_count drops to zero. ref_lock protects ref_count.
+ * The mutex protects offset and is held across I/O that uses it, so
+ * it is never taken for files that can't seek, like pipes, whose I/O
+ * can block indefinitely.
+ */
 struct fhandle {
 	char *name;
 	int flags;
 	off_t offset;
 	int ref_count;
+	struct spinlock ref_lock;
 	struct lock* mutex;
 	struct vnode* vn;
 };
 
 struct fhandle* create_fhandle(const char* name);
-void delete_fhandle(int fd);
+void fhandle_incref(struct fhandle *fh);
+void fhandle_decref(struct fhandle *fh);
+
+/*
+ * A process's descriptor table. fdt_map tracks which descriptors are
+ * in use so the lowest free one can be found without a scan of
+ * fdt_files. fdt_lock protects both; it is per process, so opens in
+ * one process do not contend with any other.
+ */
+struct fdtable {
+	struct lock *fdt_lock;
+	struct bitmap *fdt_map;
+	struct fhandle *fdt_files[__OPEN_MAX];
+};
+
+struct fdtable *fdtable_create(void);
+struct fdtable *fdtable_copy(struct fdtable *old);
+void fdtable_destroy(struct fdtable *fdt);
+int fdtable_install(struct fdtable *fdt, struct fhandle *fh, int *fd);
+int fdtable_get(struct fdtable *fdt, int fd, struct fhandle **ret);
 
 int open(const char *filename, int flags, int mode, int *error);
 int read(int fd, void *buf, size_t size, int *error);
 int write(int fd, const void *buf, size_t size, int *error);
+int pread(int fd, void *buf, size_t size, off_t offset, int *error);
+int pwrite(int fd, const void *buf, size_t size, off_t offset, int *error);
+int readv(int fd, const struct iovec *iov, int iovcnt, int *error);
+int writev(int fd, const struct iovec *iov, int iovcnt, int *error);
 int close(int fd);
+int pipe(userptr_t fds);
 
 int dup2(int oldfd, int newfd, int *error);
 off_t lseek(int fd, off_t pos, int whence, int *error);
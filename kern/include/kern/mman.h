@@ -0,0 +1,25 @@
+/*
+ * mman.h
+ *
+ *  Codes for mmap() and mprotect(), shared with userland through
+ *  <sys/mman.h>.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/* Page protections. PROT_WRITE implies PROT_READ on MIPS. */
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+/* Mapping flags. Exactly one of MAP_SHARED and MAP_PRIVATE is needed. */
+#define MAP_SHARED    0x0001
+#define MAP_PRIVATE   0x0002
+#define MAP_FIXED     0x0010   /* Put it exactly at ADDR */
+#define MAP_ANON      0x1000   /* Zero-filled memory, no file */
+#define MAP_ANONYMOUS MAP_ANON
+
+
+#endif /* _KERN_MMAN_H_ */
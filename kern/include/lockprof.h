@@ -0,0 +1,71 @@
+/*
+ * lockprof.h
+ *
+ *  Lock contention profiling, compiled in with "options lockprof".
+ *
+ *  Sleep locks and CVs carry a struct lockprof and register it when
+ *  created. Spinlocks have no name, so only those handed to
+ *  lockprof_spinlock are profiled. Times come from the ltimer in
+ *  nanoseconds of simulated time and are only taken once
+ *  lockprof_bootstrap has run, since the clock is not attached
+ *  before that.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+struct spinlock;
+
+/*
+ * For a CV, "acquires" counts waits and the wait time is time spent
+ * asleep; every wait is counted as contended and there is no hold time.
+ *
+ * Updates are made by the holder of the lock being profiled (for a
+ * CV, the lock passed to cv_wait), so they need no locking of their own.
+ */
+struct lockprof {
+	const char *lp_name;
+	const char *lp_kind;		/* "lock", "cv" or "spinlock" */
+	unsigned lp_acquires;
+	unsigned lp_contended;
+	uint64_t lp_wait_nsecs;
+	uint32_t lp_max_wait_nsecs;
+	uint32_t lp_max_hold_nsecs;
+	time_t lp_hold_secs;		/* when the current hold began */
+	uint32_t lp_hold_nsecs;
+	struct lockprof *lp_prev;	/* registry list */
+	struct lockprof *lp_next;
+};
+
+void lockprof_bootstrap(void);
+
+void lockprof_register(struct lockprof *lp, const char *kind,
+		const char *name);
+void lockprof_unregister(struct lockprof *lp);
+void lockprof_spinlock(struct spinlock *lk, const char *name);
+
+/*
+ * Accounting hooks.
+ *
+ * lockprof_now	Read the clock, or zeros before lockprof_bootstrap.
+ * lockprof_acquired
+ *		Count an acquire. If CONTENDED, charge the wait since
+ *		SECS/NSECS (from lockprof_now). Starts the hold timer.
+ * lockprof_released
+ *		Stop the hold timer.
+ */
+void lockprof_now(time_t *secs, uint32_t *nsecs);
+void lockprof_acquired(struct lockprof *lp, bool contended,
+		time_t secs, uint32_t nsecs);
+void lockprof_released(struct lockprof *lp);
+
+/* Print the N most contended locks. */
+void lockprof_printstats(unsigned n);
+
+#endif /* OPT_LOCKPROF */
+
+#endif /* _LOCKPROF_H_ */
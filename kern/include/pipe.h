@@ -0,0 +1,23 @@
+/*
+ * pipe.h
+ *
+ *  Anonymous pipes, for the pipe() system call.
+ */
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+struct vnode;
+
+/* Bytes of data a pipe holds before writers block. Power of two. */
+#define PIPE_SIZE       4096
+
+/*
+ * Make a pipe and hand back its two ends as open vnodes, one for
+ * reading and one for writing. Each is released with vfs_close. Once
+ * the write end is gone readers see EOF; once the read end is gone
+ * writers get EPIPE.
+ */
+int pipe_create(struct vnode **readvn, struct vnode **writevn);
+
+#endif /* _PIPE_H_ */
@@ -45,11 +45,13 @@ void remove_child(struct child* childlist, pid_t child_pid);
 struct addrspace *copy_parent_addrspace(struct addrspace *padrs);
 struct trapframe *copy_parent_trapframe(struct  trapframe *ptf);
 void child_fork_entry(void *data1, unsigned long data2);
+void vfork_release(void);
 
 pid_t getpid(void);
 pid_t waitpid(pid_t pid, int* status, int options, int *error);
 void _exit(int exitcode);
 pid_t fork(struct  trapframe* , int *error);
+pid_t vfork(struct trapframe *ptf, int *error);
 int execv(const char *program, char **args);
 
 vaddr_t sbrk(intptr_t amount, int* error);
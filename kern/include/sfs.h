@@ -63,6 +63,7 @@ struct sfs_fs {
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_fs *sfs_wbnext;      /* list seen by writeback thread */
 };
 
 /*
@@ -79,11 +80,60 @@ int sfs_mount(const char *device);
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
-/* Convenience functions for block I/O */
+/* Most blocks moved in one device request (must fit a uint32_t mask) */
+#define SFS_IORUN 32
+
+/*
+ * Convenience functions for block I/O. sfs_rwblock goes straight to
+ * the device; sfs_rblock and sfs_wblock copy through the buffer cache.
+ */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/*
+ * Buffer cache (sfs_cache.c), shared by all mounted volumes and keyed
+ * by (device, block). SFS_CACHE_SIZE is its memory budget in bytes.
+ *
+ * sfs_bread and sfs_bget hand back a pinned buffer; sfs_bget skips
+ * the disk read for a caller that will overwrite the whole block.
+ * Mark a modified buffer with sfs_bdirty and unpin it with sfs_brelse.
+ * Dirty buffers reach the disk when recycled, on sfs_bsync, or from
+ * sfs_bwriteback, which the writeback thread in sfs_fs.c calls once a
+ * second to write buffers that are old or too numerous.
+ */
+#define SFS_CACHE_SIZE (64*1024)
+
+struct sfs_buf;
+
+int sfs_cache_init(void);
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void *sfs_bdata(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_buf *buf);
+void sfs_brelse(struct sfs_buf *buf);
+bool sfs_bcached(struct sfs_fs *sfs, uint32_t block);
+void sfs_bforget(struct sfs_fs *sfs, uint32_t block);
+int sfs_bsync(struct sfs_fs *sfs);
+int sfs_bwriteback(void);
+void sfs_bpurge(struct sfs_fs *sfs);
+
+/*
+ * Name lookup cache (sfs_dcache.c), shared by all mounted volumes.
+ * It maps (volume, directory inode, name) to the inode and slot, or
+ * with SFS_NOINO to "not there", and must be told of every directory
+ * change through sfs_dcache_enter.
+ */
+void sfs_dcache_init(void);
+bool sfs_dcache_lookup(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		       uint32_t *ino, int *slot);
+void sfs_dcache_enter(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		      uint32_t ino, int slot);
+void sfs_dcache_purge(struct sfs_fs *sfs);
+
+/* Copy a dirty inode into the buffer cache */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
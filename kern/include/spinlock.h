@@ -45,6 +45,10 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+#include "opt-lockprof.h"
+
+struct lockprof;
+
 /*
  * Basic spinlock.
  *
@@ -57,12 +61,19 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKPROF
+	struct lockprof *lk_prof;	/* Statistics, see lockprof.h. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
+#if OPT_LOCKPROF
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, NULL }
+#else
 #define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
 
 /*
  * Spinlock functions.
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <lockprof.h>
 
 
 typedef unsigned lock_data_t;
@@ -78,8 +79,12 @@ void V(struct semaphore *);
 struct lock {
 	char *lk_name;
 	struct wchan *lk_wchan;
+	struct spinlock lk_lock;	/* protects holder and waiters */
 	struct thread *volatile lk_holder;
-	volatile spinlock_data_t lk_lock;
+	unsigned lk_waiters;		/* threads asleep on lk_wchan */
+#if OPT_LOCKPROF
+	struct lockprof lk_prof;
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -94,6 +99,10 @@ void lock_acquire(struct lock *);
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
  *
+ * The lock is adaptive: a thread that finds it held spins for a short
+ * while if the holder is running on another cpu, and otherwise sleeps
+ * on lk_wchan until the holder releases it.
+ *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
@@ -119,8 +128,9 @@ void lock_destroy(struct lock *);
 struct cv {
         char *cv_name;
         struct wchan *cv_wchan;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+#if OPT_LOCKPROF
+        struct lockprof cv_prof;
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -145,12 +155,29 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
 
 /*
  * 13 Feb 2012 : GWA : Reader-writer locks.
+ *
+ * Any number of readers may hold the lock at once; a writer holds it
+ * alone. Waiting writers take precedence: once a writer is queued, new
+ * readers sleep until it has gone through. One consequence is that a
+ * thread must not take the read lock again while already holding it.
+ *
+ *    rwlock_try_upgrade - Turn a read hold into a write hold, waiting
+ *                   for the other readers to leave. Fails (and the
+ *                   caller keeps its read hold) if another reader is
+ *                   already upgrading; the caller should then release
+ *                   and take the write lock from scratch.
  */
 
 struct rwlock {
 	char *rwlock_name;
-	struct lock *lock;
-	struct semaphore *sem;
+	struct spinlock rw_lock;	/* protects everything below */
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers and upgraders wait here */
+	unsigned rw_readers;		/* threads holding the read lock */
+	struct thread *rw_writer;	/* thread holding the write lock */
+	unsigned rw_waitreaders;
+	unsigned rw_waitwriters;
+	bool rw_upgrading;		/* a reader is waiting to upgrade */
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -160,5 +187,6 @@ void rwlock_acquire_read(struct rwlock *);
 void rwlock_release_read(struct rwlock *);
 void rwlock_acquire_write(struct rwlock *);
 void rwlock_release_write(struct rwlock *);
+bool rwlock_try_upgrade(struct rwlock *);
 
 #endif /* _SYNCH_H_ */
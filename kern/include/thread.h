@@ -44,6 +44,8 @@
 struct addrspace;
 struct cpu;
 struct vnode;
+struct fdtable;
+struct semaphore;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -86,6 +88,19 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	pid_t pid;
+
+	/*
+	 * Scheduler fields (see schedule()). Protected by the run
+	 * queue lock of t_cpu.
+	 */
+	int t_priority;			/* Queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_readysince;		/* c_hardclocks when made runnable */
+
+	/* Migration fields (see thread_consider_migration()). */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_lastrun;		/* Its c_hardclocks when it stopped */
+	unsigned t_lastmigrate;		/* c_hardclocks when last migrated */
 	/*
 	 * Interrupt state fields.
 	 *
@@ -115,7 +130,13 @@ struct thread {
 
 	/* add more here as needed */
 
-	struct fhandle* t_fdtable[__OPEN_MAX];
+	struct fdtable *t_fdtable;	/* open file descriptors */
+
+	/*
+	 * Set while t_addrspace is borrowed from a vfork parent, which
+	 * sleeps on it until we exec or exit.
+	 */
+	struct semaphore *t_vforksem;
 };
 
 /* Call once during system startup to allocate data structures. */
@@ -175,6 +196,12 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for one hardclock and preempt it if it
+ * should give up the cpu. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -51,6 +51,13 @@
 #define DIRTY 1
 #define CLEAN 2
 #define FIXED 3
+#define BUSY 4		/* being paged out; off limits until it's FREE */
+
+/*
+ * Largest block the buddy allocator manages, as a power of two pages.
+ * Requests for more than 1 << BUDDY_MAX_ORDER contiguous pages fail.
+ */
+#define BUDDY_MAX_ORDER 12
 
 /* Coremap to keep track of Physical memory */
 struct coremap_entry *coremap;
@@ -60,6 +67,25 @@ struct coremap_entry{
 	struct addrspace* as;
 	int npages;
 	int state;
+
+	/* Number of page table entries mapping this page (copy-on-write) */
+	int refcount;
+
+	/*
+	 * Swap slot still holding a copy of a CLEAN page, or -1. The
+	 * clock hand gives a page a second chance if referenced is set.
+	 */
+	int swap_slot;
+	bool referenced;
+
+	/*
+	 * Buddy allocator bookkeeping. order is the block order if this
+	 * page heads a free block and -1 otherwise; next_free/prev_free
+	 * are coremap indexes linking the free list for that order.
+	 */
+	int order;
+	int next_free;
+	int prev_free;
 };
 
 /* Initialization function */
@@ -72,8 +98,32 @@ paddr_t getppages_vm(int npages);
 void free_kpages(vaddr_t vaddr);
 
 /* Allocate/Free User page */
-vaddr_t alloc_userpage(struct addrspace *as, vaddr_t vaddr);
-void free_userpage(vaddr_t vaddr);
+paddr_t alloc_userpage(struct addrspace *as, vaddr_t vaddr, bool zero);
+void free_userpage(paddr_t paddr);
+
+/* Idle-time page zeroing (called from thread_switch) */
+bool vm_zero_idle(void);
+
+/* TLB address space IDs (called from addrspace.c) */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_flush_as(struct addrspace *as);
+
+/*
+ * Page table entry transitions. These synchronize with page-out, so
+ * pagetable.c goes through them for anything but empty entries.
+ */
+int vm_share_pte(struct addrspace *as, vaddr_t vaddr,
+		uint32_t *oldpte, uint32_t *newpte);
+void vm_free_pte(uint32_t *pte);
+void vm_protect_pte(uint32_t *pte, int flags);
+
+/* Swap space (swap.c) */
+extern bool swap_enabled;
+void swap_bootstrap(void);
+int swap_alloc_slot(unsigned *slot);
+void swap_free_slot(unsigned slot);
+int swap_out(unsigned slot, paddr_t paddr);
+int swap_in(unsigned slot, paddr_t paddr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
@@ -82,4 +132,10 @@ void vm_tlbshootdown(const struct tlbshootdown *);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Read in untouched file-mapped pages before a transfer uses them */
+int vm_prefault(vaddr_t vaddr, size_t len);
+
+/* Print page allocator statistics, and coremap_lock's lockprof record */
+void vm_printstats(void);
+
 #endif /* _VM_H_ */
@@ -0,0 +1,17 @@
+/*
+ * vm_syscalls.h
+ *
+ *  Memory mapping system calls.
+ */
+
+#ifndef VM_SYSCALLS_H_
+#define VM_SYSCALLS_H_
+
+#include <types.h>
+
+vaddr_t mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+		off_t offset, int *error);
+int munmap(vaddr_t addr, size_t len);
+int mprotect(vaddr_t addr, size_t len, int prot);
+
+#endif /* VM_SYSCALLS_H_ */
@@ -51,6 +51,8 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
+#include "opt-lockprof.h"
 
 
 /*
@@ -120,9 +122,16 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKPROF
+	/* The clock is attached now, so lock timings can start. */
+	lockprof_bootstrap();
+#endif
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+#if !OPT_DUMBVM
+	swap_bootstrap();
+#endif
 	kprintf_bootstrap();
 	thread_start_cpus();
 
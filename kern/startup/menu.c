@@ -41,9 +41,12 @@
 #include <syscall.h>
 #include <test.h>
 #include <current.h>
+#include <vm.h>
+#include <lockprof.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 
 #include <process_syscalls.h>
 
@@ -425,6 +428,46 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Command for listing the most contended locks: lp [count]
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	int n = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: lp [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n <= 0) {
+			kprintf("Usage: lp [count]\n");
+			return EINVAL;
+		}
+	}
+
+	lockprof_printstats(n);
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -526,6 +569,10 @@ static const char *mainmenu[] = {
 		"[?o] Operations menu                ",
 		"[?t] Tests menu                     ",
 		"[kh] Kernel heap stats              ",
+		"[vm] VM stats                       ",
+#if OPT_LOCKPROF
+		"[lp] Lock contention stats          ",
+#endif
 		"[q] Quit and shut down              ",
 		NULL
 };
@@ -574,6 +621,10 @@ static struct {
 
 		/* stats */
 		{ "kh",         cmd_kheapstats },
+		{ "vm",         cmd_vmstats },
+#if OPT_LOCKPROF
+		{ "lp",         cmd_lockprof },
+#endif
 
 		/* base system tests */
 		{ "at",		arraytest },
@@ -18,10 +18,13 @@
 #include <synch.h>
 #include <kern/iovec.h>
 #include <uio.h>
+#include <vm.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <bitmap.h>
 #include <file_syscalls.h>
 #include <kern/stat.h>
+#include <pipe.h>
 
 #include <process_syscalls.h>
 
@@ -44,9 +47,12 @@ struct fhandle* create_fhandle(const char* name) {
 	fobj->flags = 0;
 	fobj->offset = 0;
 	fobj->ref_count = 1;
+	spinlock_init(&fobj->ref_lock);
+	fobj->vn = NULL;
 
 	fobj->mutex = lock_create(name);
 	if (fobj->mutex == NULL ) {
+		spinlock_cleanup(&fobj->ref_lock);
 		kfree(fobj->name);
 		kfree(fobj);
 		return NULL ;
@@ -54,15 +60,143 @@ struct fhandle* create_fhandle(const char* name) {
 	return fobj;
 }
 
-void delete_fhandle(int fd) {
-	struct fhandle *fh = curthread->t_fdtable[fd];
+void fhandle_incref(struct fhandle *fh) {
+	spinlock_acquire(&fh->ref_lock);
+	KASSERT(fh->ref_count > 0);
+	fh->ref_count++;
+	spinlock_release(&fh->ref_lock);
+}
+
+/*
+ * Drop a reference, closing the vnode and freeing the handle with
+ * the last one.
+ */
+void fhandle_decref(struct fhandle *fh) {
+	spinlock_acquire(&fh->ref_lock);
+	KASSERT(fh->ref_count > 0);
+	fh->ref_count--;
+	if (fh->ref_count > 0) {
+		spinlock_release(&fh->ref_lock);
+		return;
+	}
+	spinlock_release(&fh->ref_lock);
+
+	if (fh->vn != NULL) {
+		vfs_close(fh->vn);
+	}
+	spinlock_cleanup(&fh->ref_lock);
 	lock_destroy(fh->mutex);
 	kfree(fh->name);
-	//kfree(fh->vn);
 	kfree(fh);
-	curthread->t_fdtable[fd] = NULL;
 }
 
+
+struct fdtable *fdtable_create(void) {
+
+	struct fdtable *fdt;
+
+	fdt = kmalloc(sizeof(struct fdtable));
+	if (fdt == NULL) {
+		return NULL;
+	}
+
+	fdt->fdt_lock = lock_create("fdtable");
+	if (fdt->fdt_lock == NULL) {
+		kfree(fdt);
+		return NULL;
+	}
+
+	fdt->fdt_map = bitmap_create(__OPEN_MAX);
+	if (fdt->fdt_map == NULL) {
+		lock_destroy(fdt->fdt_lock);
+		kfree(fdt);
+		return NULL;
+	}
+
+	for (int i = 0; i < __OPEN_MAX; i++) {
+		fdt->fdt_files[i] = NULL;
+	}
+	return fdt;
+}
+
+/*
+ * Table for a forked child: same descriptors, each sharing the
+ * parent's open file.
+ */
+struct fdtable *fdtable_copy(struct fdtable *old) {
+
+	struct fdtable *fdt;
+
+	fdt = fdtable_create();
+	if (fdt == NULL) {
+		return NULL;
+	}
+
+	lock_acquire(old->fdt_lock);
+	for (int i = 0; i < __OPEN_MAX; i++) {
+		if (old->fdt_files[i] != NULL) {
+			fhandle_incref(old->fdt_files[i]);
+			fdt->fdt_files[i] = old->fdt_files[i];
+			bitmap_mark(fdt->fdt_map, i);
+		}
+	}
+	lock_release(old->fdt_lock);
+
+	return fdt;
+}
+
+void fdtable_destroy(struct fdtable *fdt) {
+
+	for (int i = 0; i < __OPEN_MAX; i++) {
+		if (fdt->fdt_files[i] != NULL) {
+			fhandle_decref(fdt->fdt_files[i]);
+			fdt->fdt_files[i] = NULL;
+		}
+	}
+	bitmap_destroy(fdt->fdt_map);
+	lock_destroy(fdt->fdt_lock);
+	kfree(fdt);
+}
+
+/*
+ * Put FH in the lowest free descriptor. The table takes over the
+ * caller's reference.
+ */
+int fdtable_install(struct fdtable *fdt, struct fhandle *fh, int *fd) {
+
+	unsigned index;
+
+	lock_acquire(fdt->fdt_lock);
+	if (bitmap_alloc(fdt->fdt_map, &index)) {
+		lock_release(fdt->fdt_lock);
+		return EMFILE;
+	}
+	KASSERT(fdt->fdt_files[index] == NULL);
+	fdt->fdt_files[index] = fh;
+	lock_release(fdt->fdt_lock);
+
+	*fd = index;
+	return 0;
+}
+
+/*
+ * Look up FD. Only the owning thread uses a table, so the handle
+ * stays valid until that thread closes the descriptor.
+ */
+int fdtable_get(struct fdtable *fdt, int fd, struct fhandle **ret) {
+
+	if (fdt == NULL || fd < 0 || fd >= __OPEN_MAX) {
+		return EBADF;
+	}
+
+	lock_acquire(fdt->fdt_lock);
+	*ret = fdt->fdt_files[fd];
+	lock_release(fdt->fdt_lock);
+
+	return *ret == NULL ? EBADF : 0;
+}
+
+
 int open(const char *filename, int flags, int mode, int *error) {
 	struct fhandle *fh;
 	int fd = 0;
@@ -87,155 +221,379 @@ int open(const char *filename, int flags, int mode, int *error) {
 		return -1;
 	}
 
-	if(strlen(filename)==0)
+	if(strlen(kfilename)==0)
 	{
 		*error = EINVAL;
 		return -1;
 	}
 
-	lock_acquire(pid_array_lock);
-	int i;
-	for (i = 3; i < __OPEN_MAX; i++) {
-		if (curthread->t_fdtable[i] == NULL ) {
-			curthread->t_fdtable[i] = create_fhandle(kfilename);
-			fh = curthread->t_fdtable[i];
-			fd = i;
-			break;
-		}
-	}
-	if (i == __OPEN_MAX) {
-		*error = EMFILE;
-		lock_release(pid_array_lock);
+	fh = create_fhandle(kfilename);
+	if (fh == NULL) {
+		*error = ENOMEM;
 		return -1;
 	}
+	fh->flags = flags;
 
 	*error = vfs_open((char*) kfilename, flags, mode, &fh->vn);
+	if(*error != 0){
+		fh->vn = NULL;
+		fhandle_decref(fh);
+		return -1;
+	}
 
+	*error = fdtable_install(curthread->t_fdtable, fh, &fd);
 	if(*error != 0){
-		delete_fhandle(fd);
-		lock_release(pid_array_lock);
+		fhandle_decref(fh);
 		return -1;
 	}
 
-	lock_release(pid_array_lock);
 	return fd;
 }
 
 int close(int fd) {
 
-	if (fd < 0 || fd > __OPEN_MAX) {
+	struct fdtable *fdt = curthread->t_fdtable;
+	struct fhandle *fh;
+
+	if (fdt == NULL || fd < 0 || fd >= __OPEN_MAX) {
 		return EBADF;
-	} else {
-		struct fhandle *fh = curthread->t_fdtable[fd];
-		if(fh==NULL)
-			return EBADF;
-		lock_acquire(fh->mutex);
-		fh->ref_count--;
+	}
 
-		if (fh->ref_count == 0) {
-			vfs_close(fh->vn);
-			lock_release(fh->mutex);
-			delete_fhandle(fd);
-			return 0;
+	lock_acquire(fdt->fdt_lock);
+	fh = fdt->fdt_files[fd];
+	if (fh == NULL) {
+		lock_release(fdt->fdt_lock);
+		return EBADF;
+	}
+	fdt->fdt_files[fd] = NULL;
+	bitmap_unmark(fdt->fdt_map, fd);
+	lock_release(fdt->fdt_lock);
+
+	fhandle_decref(fh);
+	return 0;
+}
+
+/*
+ * Make a pipe and copy its read and write descriptors out to FDS.
+ */
+int pipe(userptr_t fds) {
+
+	struct fdtable *fdt = curthread->t_fdtable;
+	struct fhandle *rfh, *wfh;
+	struct vnode *rvn, *wvn;
+	int kfds[2];
+	int err;
+
+	err = pipe_create(&rvn, &wvn);
+	if (err != 0) {
+		return err;
+	}
+
+	rfh = create_fhandle("pipe:read");
+	wfh = create_fhandle("pipe:write");
+	if (rfh == NULL || wfh == NULL) {
+		if (rfh != NULL) {
+			fhandle_decref(rfh);
 		}
-		lock_release(fh->mutex);
-		return 0;
+		if (wfh != NULL) {
+			fhandle_decref(wfh);
+		}
+		vfs_close(rvn);
+		vfs_close(wvn);
+		return ENOMEM;
+	}
+	rfh->flags = O_RDONLY;
+	rfh->vn = rvn;
+	wfh->flags = O_WRONLY;
+	wfh->vn = wvn;
+
+	err = fdtable_install(fdt, rfh, &kfds[0]);
+	if (err != 0) {
+		fhandle_decref(rfh);
+		fhandle_decref(wfh);
+		return err;
+	}
+	err = fdtable_install(fdt, wfh, &kfds[1]);
+	if (err != 0) {
+		close(kfds[0]);
+		fhandle_decref(wfh);
+		return err;
+	}
+
+	err = copyout(kfds, fds, sizeof(kfds));
+	if (err != 0) {
+		close(kfds[0]);
+		close(kfds[1]);
+		return err;
 	}
 	return 0;
 }
 
-int read(int fd, void *buf, size_t size, int* error) {
+/*
+ * Look up FD for I/O in direction RW, refusing descriptors that were
+ * not opened for it.
+ */
+static int file_get_rw(int fd, enum uio_rw rw, struct fhandle **ret) {
 
-	if ( fd < 0 || fd > __OPEN_MAX) {
-		*error = EBADF;
-		return -1;
-	} else if (buf == NULL) {
-		*error = EFAULT;
-		return -1;
-	} else {
-		struct fhandle *fh = curthread->t_fdtable[fd];
-		if(fh==NULL)
-		{
-			*error = EBADF;
-			return -1;
+	struct fhandle *fh;
+	int accmode, result;
+
+	result = fdtable_get(curthread->t_fdtable, fd, &fh);
+	if (result != 0) {
+		return result;
+	}
+	accmode = fh->flags & O_ACCMODE;
+	if ((rw == UIO_READ && accmode == O_WRONLY) ||
+			(rw == UIO_WRITE && accmode == O_RDONLY)) {
+		return EBADF;
+	}
+	*ret = fh;
+	return 0;
+}
+
+/*
+ * Do the I/O set up in UIO on FH and return the number of bytes moved.
+ *
+ * If SHARED is set the transfer starts at, and advances, the offset
+ * shared by everyone with the file open, under fh->mutex. Otherwise
+ * (pread and pwrite) UIO already has its own offset, which is checked
+ * here, and fh->mutex is not taken at all, so positioned I/O on a
+ * shared descriptor doesn't serialize on it.
+ *
+ * Files that can't seek, like pipes and the console, have no offset to
+ * share and can block indefinitely, so they never take fh->mutex
+ * either; close and fork would otherwise wait on a blocked reader.
+ */
+static int file_rw(struct fhandle *fh, struct uio *uio, bool shared,
+		int *error) {
+
+	size_t len = uio->uio_resid;
+	bool locked = false;
+	int i;
+
+	/* Mapped file pages can't fault in mid-transfer; see vm_prefault */
+	if (uio->uio_segflg == UIO_USERSPACE) {
+		for (i = 0; i < uio->uio_iovcnt; i++) {
+			*error = vm_prefault((vaddr_t)uio->uio_iov[i].iov_ubase,
+					uio->uio_iov[i].iov_len);
+			if (*error != 0) {
+				return -1;
+			}
 		}
+	}
 
+	if (shared && VOP_TRYSEEK(fh->vn, 0) != 0) {
+		uio->uio_offset = 0;
+	} else if (shared) {
 		lock_acquire(fh->mutex);
-		struct iovec iovec_obj;
-		struct uio uio_obj;
-		uio_init(&iovec_obj, &uio_obj, (void *) buf, size, fh->offset, UIO_READ);
-		*error = VOP_READ(fh->vn, &uio_obj);
-		if(*error != 0){
-			lock_release(fh->mutex);
-			kfree((void*)buf);
+		locked = true;
+		uio->uio_offset = fh->offset;
+	} else {
+		if (uio->uio_offset < 0) {
+			*error = EINVAL;
+			return -1;
+		}
+		/* Refuses things like the console, which can't seek. */
+		*error = VOP_TRYSEEK(fh->vn, uio->uio_offset);
+		if (*error != 0) {
 			return -1;
 		}
-		int bytes_processed = uio_obj.uio_offset -fh->offset;
-		fh->offset = uio_obj.uio_offset;
+	}
+
+	if (uio->uio_rw == UIO_READ) {
+		*error = VOP_READ(fh->vn, uio);
+	} else {
+		*error = VOP_WRITE(fh->vn, uio);
+	}
+
+	if (locked) {
+		if (*error == 0) {
+			fh->offset = uio->uio_offset;
+		}
 		lock_release(fh->mutex);
-		return bytes_processed;
 	}
-	return 0;
+	if (*error != 0) {
+		return -1;
+	}
+	return len - uio->uio_resid;
+}
+
+/* Largest transfer whose length fits the int we return. */
+#define FILE_RW_MAX 0x7fffffff
+
+/*
+ * Common part of readv and writev: copy in the user's iovec array and
+ * build a uio over all of it.
+ */
+static int file_rwv(int fd, const struct iovec *iov, int iovcnt,
+		enum uio_rw rw, int *error) {
+
+	struct fhandle *fh;
+	struct iovec *kiov;
+	struct uio uio_obj;
+	size_t total = 0;
+	int i, result;
+
+	*error = file_get_rw(fd, rw, &fh);
+	if (*error != 0) {
+		return -1;
+	}
+	if (iovcnt <= 0 || iovcnt > __IOV_MAX) {
+		*error = EINVAL;
+		return -1;
+	}
+
+	kiov = kmalloc(iovcnt * sizeof(struct iovec));
+	if (kiov == NULL) {
+		*error = ENOMEM;
+		return -1;
+	}
+	*error = copyin((const_userptr_t) iov, kiov,
+			iovcnt * sizeof(struct iovec));
+	if (*error != 0) {
+		kfree(kiov);
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (kiov[i].iov_len > FILE_RW_MAX - total) {
+			kfree(kiov);
+			*error = EINVAL;
+			return -1;
+		}
+		total += kiov[i].iov_len;
+	}
+
+	uio_obj.uio_iov = kiov;
+	uio_obj.uio_iovcnt = iovcnt;
+	uio_obj.uio_offset = 0;
+	uio_obj.uio_resid = total;
+	uio_obj.uio_segflg = UIO_USERSPACE;
+	uio_obj.uio_rw = rw;
+	uio_obj.uio_space = curthread->t_addrspace;
+
+	result = file_rw(fh, &uio_obj, true, error);
+	kfree(kiov);
+	return result;
+}
+
+int read(int fd, void *buf, size_t size, int* error) {
+
+	struct fhandle *fh;
+	struct iovec iovec_obj;
+	struct uio uio_obj;
+
+	*error = file_get_rw(fd, UIO_READ, &fh);
+	if (*error != 0) {
+		return -1;
+	} else if (buf == NULL) {
+		*error = EFAULT;
+		return -1;
+	}
+	uio_init(&iovec_obj, &uio_obj, buf, size, 0, UIO_READ);
+	return file_rw(fh, &uio_obj, true, error);
 }
 
 int write(int fd, const void *buf, size_t size, int* error) {
 
-	if ( fd < 0 || fd > __OPEN_MAX) {
-		*error = EBADF;
+	struct fhandle *fh;
+	struct iovec iovec_obj;
+	struct uio uio_obj;
+
+	*error = file_get_rw(fd, UIO_WRITE, &fh);
+	if (*error != 0) {
 		return -1;
 	} else if (buf == NULL) {
 		*error = EFAULT;
 		return -1;
-	} else {
-		struct fhandle *fh = curthread->t_fdtable[fd];
-		if (fh == NULL )
-		{
-			*error = EBADF;
-			return -1;
-		}
+	}
+	uio_init(&iovec_obj, &uio_obj, (void *) buf, size, 0, UIO_WRITE);
+	return file_rw(fh, &uio_obj, true, error);
+}
 
-		lock_acquire(fh->mutex);
-		struct iovec iovec_obj;
-		struct uio uio_obj;
-		uio_init(&iovec_obj, &uio_obj, (void *) buf, size, fh->offset, UIO_WRITE);
-		*error = VOP_WRITE(fh->vn, &uio_obj);
-		if(*error != 0){
-			lock_release(fh->mutex);
-			kfree((void*)buf);
-			return -1;
-		}
-		int bytes_processed = size - uio_obj.uio_resid;
-		fh->offset = uio_obj.uio_offset;
-		lock_release(fh->mutex);
-		return bytes_processed;
+int pread(int fd, void *buf, size_t size, off_t offset, int *error) {
+
+	struct fhandle *fh;
+	struct iovec iovec_obj;
+	struct uio uio_obj;
+
+	*error = file_get_rw(fd, UIO_READ, &fh);
+	if (*error != 0) {
+		return -1;
+	} else if (buf == NULL) {
+		*error = EFAULT;
+		return -1;
 	}
-	return 0;
+	uio_init(&iovec_obj, &uio_obj, buf, size, offset, UIO_READ);
+	return file_rw(fh, &uio_obj, false, error);
+}
+
+int pwrite(int fd, const void *buf, size_t size, off_t offset, int *error) {
+
+	struct fhandle *fh;
+	struct iovec iovec_obj;
+	struct uio uio_obj;
+
+	*error = file_get_rw(fd, UIO_WRITE, &fh);
+	if (*error != 0) {
+		return -1;
+	} else if (buf == NULL) {
+		*error = EFAULT;
+		return -1;
+	}
+	uio_init(&iovec_obj, &uio_obj, (void *) buf, size, offset, UIO_WRITE);
+	return file_rw(fh, &uio_obj, false, error);
+}
+
+int readv(int fd, const struct iovec *iov, int iovcnt, int *error) {
+	return file_rwv(fd, iov, iovcnt, UIO_READ, error);
+}
+
+int writev(int fd, const struct iovec *iov, int iovcnt, int *error) {
+	return file_rwv(fd, iov, iovcnt, UIO_WRITE, error);
 }
 
 
 int dup2(int oldfd, int newfd , int *error){
 
-	if(	oldfd <0 ||
-			oldfd>__OPEN_MAX ||
+	struct fdtable *fdt = curthread->t_fdtable;
+	struct fhandle *fh, *old;
+
+	if(	fdt == NULL ||
+			oldfd <0 ||
+			oldfd>=__OPEN_MAX ||
 			newfd<0 ||
-			curthread->t_fdtable[oldfd] == NULL ||
 			newfd >=__OPEN_MAX 	)
 	{
 		*error = EBADF;
 		return -1;
 	}
-	else
+
+	lock_acquire(fdt->fdt_lock);
+	fh = fdt->fdt_files[oldfd];
+	if(fh == NULL)
 	{
-		if(curthread->t_fdtable[newfd] != NULL)
-		{
-			*error = close(newfd);
-			if(*error >0)
-				return -1;
-		}
-		curthread->t_fdtable[newfd] = curthread->t_fdtable[oldfd];
-		lock_acquire(curthread->t_fdtable[newfd]->mutex);
-		curthread->t_fdtable[newfd]->ref_count++;
-		lock_release(curthread->t_fdtable[newfd]->mutex);
+		lock_release(fdt->fdt_lock);
+		*error = EBADF;
+		return -1;
+	}
+	if(oldfd == newfd)
+	{
+		lock_release(fdt->fdt_lock);
+		return newfd;
+	}
+
+	fhandle_incref(fh);
+	old = fdt->fdt_files[newfd];
+	fdt->fdt_files[newfd] = fh;
+	if(old == NULL)
+	{
+		bitmap_mark(fdt->fdt_map, newfd);
+	}
+	lock_release(fdt->fdt_lock);
+
+	if(old != NULL)
+	{
+		fhandle_decref(old);
 	}
 	return newfd;
 }
@@ -244,8 +602,10 @@ int dup2(int oldfd, int newfd , int *error){
 off_t lseek(int fd, off_t pos, int whence , int *error)
 {
 	struct fhandle *fh ;
-	if ( fd < 0 || fd >= 128) {
-		*error = EBADF;
+
+	*error = fdtable_get(curthread->t_fdtable, fd, &fh);
+	if(*error != 0)
+	{
 		return -1;
 	}
 	else if(whence != SEEK_SET
@@ -255,48 +615,39 @@ off_t lseek(int fd, off_t pos, int whence , int *error)
 		*error = EINVAL;
 		return -1;
 	}
-	else
-	{
-		// valid lseek
-		fh = curthread->t_fdtable[fd];
-		if(fh==NULL)
-		{
-			*error = EBADF;
-			return -1;
-		}
-		struct stat st;
-		int position_new = fh->offset;
-
-		switch(whence){
-		case SEEK_SET:
-			position_new = pos;
-			break;
-		case SEEK_CUR:
-			position_new = fh->offset + pos;
-			break;
-		case SEEK_END:
-			VOP_STAT(fh->vn,&st);
-			position_new = st.st_size + pos;
-			break;
-		}
 
-		if(position_new < 0){
-			*error = EINVAL;
-			return -1;
-		}
+	struct stat st;
+	off_t position_new;
+
+	lock_acquire(fh->mutex);
+	switch(whence){
+	case SEEK_SET:
+		position_new = pos;
+		break;
+	case SEEK_CUR:
+		position_new = fh->offset + pos;
+		break;
+	default:
+		VOP_STAT(fh->vn,&st);
+		position_new = st.st_size + pos;
+		break;
+	}
 
-		lock_acquire(fh->mutex);
-		*error = VOP_TRYSEEK(fh->vn, position_new);
+	if(position_new < 0){
 		lock_release(fh->mutex);
-		if(*error != 0){
-			return -1;
-		}
+		*error = EINVAL;
+		return -1;
+	}
 
-		fh->offset = position_new;
-		//kprintf("\nOffset: %ld  position: %ld",(long)fh->offset,(long)pos);
-		return fh->offset;
+	*error = VOP_TRYSEEK(fh->vn, position_new);
+	if(*error != 0){
+		lock_release(fh->mutex);
+		return -1;
 	}
-	return fh->offset;
+
+	fh->offset = position_new;
+	lock_release(fh->mutex);
+	return position_new;
 }
 
 int chdir(const char *pathname)
@@ -108,11 +108,13 @@ pid_t fork(struct trapframe *ptf, int *error)
 	}
 	memcpy(ctf, ptf, sizeof(struct trapframe));
 
-	struct addrspace *caddr = kmalloc(sizeof(struct addrspace));
+	// as_copy creates the child's address space itself
+	struct addrspace *caddr = NULL;
 	*error = as_copy(curthread->t_addrspace, &caddr);
 
 	// new
 	if(*error > 0){
+		kfree(ctf);
 		return -1;
 	}
 
@@ -152,6 +154,76 @@ void child_fork_entry(void *data1, unsigned long data2)
 	//KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf_copy));
 }
 
+/*
+ * vfork: the child runs in our address space, with no copy made,
+ * while we sleep until it execs or exits. Everything the child needs
+ * is read from our kernel stack before it can get that far.
+ */
+struct vfork_args {
+	struct trapframe *va_tf;
+	struct addrspace *va_as;
+	struct semaphore *va_sem;
+	pid_t va_pid;
+};
+
+static void child_vfork_entry(void *data1, unsigned long data2)
+{
+	struct vfork_args *va = data1;
+	struct trapframe tf;
+
+	(void)data2;
+
+	memcpy(&tf, va->va_tf, sizeof(struct trapframe));
+	tf.tf_a3 = 0;
+	tf.tf_v0 = 0;
+	tf.tf_epc = tf.tf_epc + 4;
+
+	va->va_pid = curthread->pid;
+	curthread->t_vforksem = va->va_sem;
+	curthread->t_addrspace = va->va_as;
+	as_activate(curthread->t_addrspace);
+
+	mips_usermode(&tf);
+}
+
+pid_t vfork(struct trapframe *ptf, int *error)
+{
+	struct vfork_args va;
+
+	va.va_tf = ptf;
+	va.va_as = curthread->t_addrspace;
+	va.va_sem = sem_create("vfork", 0);
+	if (va.va_sem == NULL) {
+		*error = ENOMEM;
+		return -1;
+	}
+
+	*error = thread_fork("vfork", child_vfork_entry, &va, 0, NULL);
+	if (*error != 0) {
+		sem_destroy(va.va_sem);
+		return -1;
+	}
+
+	P(va.va_sem);
+	sem_destroy(va.va_sem);
+	as_activate(curthread->t_addrspace);
+
+	return va.va_pid;
+}
+
+/*
+ * Wake the vfork parent. Called by the child once it is done with the
+ * borrowed address space, from execv or thread_exit.
+ */
+void vfork_release(void)
+{
+	struct semaphore *sem = curthread->t_vforksem;
+
+	KASSERT(sem != NULL);
+	curthread->t_vforksem = NULL;
+	V(sem);
+}
+
 struct addrspace* copy_parent_addrspace(struct addrspace *padrs)
 {
 	struct addrspace *cadrs;
@@ -258,6 +330,8 @@ void _exit(int exitcode){
 	}
 }
 
+static void execv_restore(struct addrspace *oldas);
+
 int
 execv(const char *prog_name, char **argv)
 {
@@ -314,9 +388,14 @@ execv(const char *prog_name, char **argv)
 	/* We should be a new thread. */
 	//KASSERT(curthread->t_addrspace == NULL);
 
-	/* Create a new address space. */
+	/*
+	 * Create a new address space. The old one is kept until the new
+	 * one is set up, so a failed exec returns to it.
+	 */
+	struct addrspace *oldas = curthread->t_addrspace;
 	curthread->t_addrspace = as_create();
 	if (curthread->t_addrspace==NULL) {
+		curthread->t_addrspace = oldas;
 		vfs_close(v);
 		return ENOMEM;
 	}
@@ -327,8 +406,8 @@ execv(const char *prog_name, char **argv)
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
 	if (result) {
-		/* thread_exit destroys curthread->t_addrspace */
 		vfs_close(v);
+		execv_restore(oldas);
 		return result;
 	}
 
@@ -338,7 +417,7 @@ execv(const char *prog_name, char **argv)
 	/* Define the user stack in the address space */
 	result = as_define_stack(curthread->t_addrspace, &stackptr);
 	if (result) {
-		/* thread_exit destroys curthread->t_addrspace */
+		execv_restore(oldas);
 		return result;
 	}
 
@@ -367,6 +446,14 @@ execv(const char *prog_name, char **argv)
 
 		stackptr = stackptr - (argc)*sizeof(vaddr_t);
 
+		/* Done with the old address space, which may be borrowed. */
+		if (curthread->t_vforksem != NULL) {
+			vfork_release();
+		}
+		else if (oldas != NULL) {
+			as_destroy(oldas);
+		}
+
 		/* Warp to user mode. */
 		enter_new_process( argc /*argc*/, (userptr_t) stackptr /*userspace addr of argv*/,
 				stackptr, entrypoint);
@@ -376,12 +463,25 @@ execv(const char *prog_name, char **argv)
 	return EINVAL;
 }
 
+/*
+ * Back out of a failed execv to the address space we came in with.
+ */
+static void execv_restore(struct addrspace *oldas)
+{
+	struct addrspace *as = curthread->t_addrspace;
+
+	curthread->t_addrspace = oldas;
+	as_activate(oldas);
+	as_destroy(as);
+}
+
 vaddr_t
 sbrk(intptr_t amount, int *error){
 
 	struct addrspace *as = curthread->t_addrspace;
 	vaddr_t prev_hend = as->hend;
 	vaddr_t stackTop = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	vaddr_t heappage = (as->hend + PAGE_SIZE - 1) & PAGE_FRAME;
 
 	if((as->hend + amount) < as->hstart){
 		*error = EINVAL;
@@ -389,6 +489,11 @@ sbrk(intptr_t amount, int *error){
 	}else if((as->hend + amount) > stackTop){
 		*error = ENOMEM;
 		return -1;
+	}else if((as->hend + amount) > heappage && !as_range_free(as, heappage,
+			(as->hend + amount - heappage + PAGE_SIZE - 1) / PAGE_SIZE)){
+		/* Would run into an mmap */
+		*error = ENOMEM;
+		return -1;
 	}
 
 	//KASSERT(amount>0);
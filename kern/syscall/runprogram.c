@@ -102,25 +102,39 @@ runprogram(char *progname, char **argv, int argc)
 	}
 
 
-	//stdin,out,err
+	//stdin,out,err, in the lowest descriptors of a fresh table
 
-	char *name = NULL;
-
-	name = kstrdup("con:");
-	curthread->t_fdtable[0] = create_fhandle(name);
-	vfs_open(name, O_RDONLY, 0664, &(curthread->t_fdtable[0]->vn));
-	kfree(name);
+	if (curthread->t_fdtable != NULL) {
+		fdtable_destroy(curthread->t_fdtable);
+	}
+	curthread->t_fdtable = fdtable_create();
+	if (curthread->t_fdtable == NULL) {
+		return ENOMEM;
+	}
 
-	name = kstrdup("con:");
-	curthread->t_fdtable[1] = create_fhandle(name);
-	vfs_open(name, O_WRONLY, 0664, &(curthread->t_fdtable[1]->vn));
-	kfree(name);
+	for (int fd = 0; fd < 3; fd++) {
+		char name[] = "con:";
+		struct fhandle *fh;
+		int stdfd;
 
-	name = kstrdup("con:");
-	curthread->t_fdtable[2] = create_fhandle(name);
-	vfs_open(name, O_WRONLY, 0664, &(curthread->t_fdtable[2]->vn));
-	kfree(name);
-	//
+		fh = create_fhandle(name);
+		if (fh == NULL) {
+			return ENOMEM;
+		}
+		fh->flags = fd == 0 ? O_RDONLY : O_WRONLY;
+		result = vfs_open(name, fh->flags, 0664, &fh->vn);
+		if (result) {
+			fh->vn = NULL;
+			fhandle_decref(fh);
+			return result;
+		}
+		result = fdtable_install(curthread->t_fdtable, fh, &stdfd);
+		if (result) {
+			fhandle_decref(fh);
+			return result;
+		}
+		KASSERT(stdfd == fd);
+	}
 
 
 	int i;
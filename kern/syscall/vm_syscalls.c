@@ -0,0 +1,157 @@
+/*
+ * vm_syscalls.c
+ *
+ *  mmap, munmap and mprotect. The address space work is done by
+ *  as_define_mmap, as_unmap and as_protect; pages are filled in by
+ *  vm_fault when first touched.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <vm.h>
+#include <file_syscalls.h>
+#include <vm_syscalls.h>
+
+#if PROT_READ != REGION_READ || PROT_WRITE != REGION_WRITE || \
+	PROT_EXEC != REGION_EXEC
+#error "PROT_* and REGION_* permission bits differ"
+#endif
+
+#define PROT_ALL (PROT_READ | PROT_WRITE | PROT_EXEC)
+
+
+/*
+ * Check a page range passed in from userland and count its pages.
+ */
+static int vm_user_range(vaddr_t addr, size_t len, size_t *npages){
+
+	if((addr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0){
+		return EINVAL;
+	}
+	if(addr >= USERSPACETOP || len > USERSPACETOP - addr){
+		return EINVAL;
+	}
+	*npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	return 0;
+}
+
+
+vaddr_t
+mmap(vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset,
+		int *error){
+
+	struct addrspace *as = curthread->t_addrspace;
+	struct fhandle *fh;
+	struct vnode *vn = NULL;
+	int sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+	int rgflags;
+	size_t npages;
+
+	if(len == 0 || (prot & ~PROT_ALL) != 0 ||
+			(sharing != MAP_SHARED && sharing != MAP_PRIVATE) ||
+			(flags & ~(MAP_SHARED|MAP_PRIVATE|MAP_FIXED|MAP_ANON))){
+		*error = EINVAL;
+		return -1;
+	}
+	if(len > as->as_stackvbase){
+		*error = ENOMEM;
+		return -1;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	/* Nothing would carry writes to other mappings or the file. */
+	if(sharing == MAP_SHARED && (prot & PROT_WRITE)){
+		*error = EUNIMP;
+		return -1;
+	}
+	rgflags = prot | (sharing == MAP_SHARED ? REGION_SHARED : 0);
+
+	if(!(flags & MAP_ANON)){
+		if(offset < 0 || offset % PAGE_SIZE != 0){
+			*error = EINVAL;
+			return -1;
+		}
+		*error = fdtable_get(curthread->t_fdtable, fd, &fh);
+		if(*error){
+			return -1;
+		}
+		if((fh->flags & O_ACCMODE) == O_WRONLY){
+			*error = EACCES;
+			return -1;
+		}
+		vn = fh->vn;
+		*error = VOP_MMAP(vn);
+		if(*error){
+			return -1;
+		}
+	}else{
+		offset = 0;
+	}
+
+	if(flags & MAP_FIXED){
+		/* MAP_FIXED replaces whatever was mapped there before. */
+		*error = vm_user_range(addr, len, &npages);
+		if(*error){
+			return -1;
+		}
+		*error = as_unmap(as, addr, npages);
+		if(*error){
+			return -1;
+		}
+		if(!as_range_free(as, addr, npages)){
+			*error = EINVAL;
+			return -1;
+		}
+	}else if(addr == 0 || (addr & ~(vaddr_t)PAGE_FRAME) != 0 ||
+			!as_range_free(as, addr, npages)){
+		/* The address is only a hint. */
+		*error = as_find_free(as, npages, &addr);
+		if(*error){
+			return -1;
+		}
+	}
+
+	*error = as_define_mmap(as, addr, npages, rgflags, vn, offset);
+	if(*error){
+		return -1;
+	}
+	return addr;
+}
+
+
+int
+munmap(vaddr_t addr, size_t len){
+
+	size_t npages;
+	int result;
+
+	result = vm_user_range(addr, len, &npages);
+	if(result){
+		return result;
+	}
+	return as_unmap(curthread->t_addrspace, addr, npages);
+}
+
+
+int
+mprotect(vaddr_t addr, size_t len, int prot){
+
+	size_t npages;
+	int result;
+
+	if((prot & ~PROT_ALL) != 0){
+		return EINVAL;
+	}
+	result = vm_user_range(addr, len, &npages);
+	if(result){
+		return result;
+	}
+	return as_protect(curthread->t_addrspace, addr, npages, prot);
+}
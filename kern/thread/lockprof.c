@@ -0,0 +1,218 @@
+/*
+ * lockprof.c
+ *
+ *  Lock contention profiling. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+/* Most locks lockprof_printstats will list, and how much of each name. */
+#define LOCKPROF_MAXTOP 16
+#define LOCKPROF_NAMELEN 20
+
+/* All registered records. The list lock itself is not profiled. */
+static struct lockprof *lockprof_list = NULL;
+static struct spinlock lockprof_listlock = SPINLOCK_INITIALIZER;
+
+static volatile bool lockprof_enabled = false;
+
+
+/*
+ * Start taking times. Called once the clock device is attached.
+ */
+void lockprof_bootstrap(void){
+	lockprof_enabled = true;
+}
+
+
+void lockprof_register(struct lockprof *lp, const char *kind,
+		const char *name){
+
+	lp->lp_name = name;
+	lp->lp_kind = kind;
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_wait_nsecs = 0;
+	lp->lp_max_wait_nsecs = 0;
+	lp->lp_max_hold_nsecs = 0;
+	lp->lp_hold_secs = 0;
+	lp->lp_hold_nsecs = 0;
+
+	spinlock_acquire(&lockprof_listlock);
+	lp->lp_prev = NULL;
+	lp->lp_next = lockprof_list;
+	if(lockprof_list != NULL){
+		lockprof_list->lp_prev = lp;
+	}
+	lockprof_list = lp;
+	spinlock_release(&lockprof_listlock);
+}
+
+
+void lockprof_unregister(struct lockprof *lp){
+
+	spinlock_acquire(&lockprof_listlock);
+	if(lp->lp_prev != NULL){
+		lp->lp_prev->lp_next = lp->lp_next;
+	}else{
+		KASSERT(lockprof_list == lp);
+		lockprof_list = lp->lp_next;
+	}
+	if(lp->lp_next != NULL){
+		lp->lp_next->lp_prev = lp->lp_prev;
+	}
+	lp->lp_prev = lp->lp_next = NULL;
+	spinlock_release(&lockprof_listlock);
+}
+
+
+/*
+ * Start profiling spinlock LK under NAME, which must stay valid for
+ * as long as the spinlock does. Intended for long-lived global locks.
+ */
+void lockprof_spinlock(struct spinlock *lk, const char *name){
+
+	struct lockprof *lp;
+
+	KASSERT(lk->lk_prof == NULL);
+
+	lp = kmalloc(sizeof(struct lockprof));
+	if(lp == NULL){
+		kprintf("lockprof: Out of memory profiling %s\n", name);
+		return;
+	}
+	lockprof_register(lp, "spinlock", name);
+	lk->lk_prof = lp;
+}
+
+
+void lockprof_now(time_t *secs, uint32_t *nsecs){
+
+	if(!lockprof_enabled){
+		*secs = 0;
+		*nsecs = 0;
+		return;
+	}
+	gettime(secs, nsecs);
+}
+
+
+static uint32_t lockprof_since(time_t secs, uint32_t nsecs){
+
+	time_t now, rsecs;
+	uint32_t nnow, rnsecs;
+
+	gettime(&now, &nnow);
+	getinterval(secs, nsecs, now, nnow, &rsecs, &rnsecs);
+	/* Saturate rather than wrap; 32 bits of ns is about 4 seconds. */
+	if(rsecs >= 4){
+		return 0xffffffff;
+	}
+	return rsecs * 1000000000 + rnsecs;
+}
+
+
+void lockprof_acquired(struct lockprof *lp, bool contended,
+		time_t secs, uint32_t nsecs){
+
+	uint32_t waited;
+
+	if(!lockprof_enabled){
+		return;
+	}
+
+	lp->lp_acquires++;
+	if(contended){
+		lp->lp_contended++;
+		/* A zero start time was taken before bootstrap. */
+		if(secs != 0 || nsecs != 0){
+			waited = lockprof_since(secs, nsecs);
+			lp->lp_wait_nsecs += waited;
+			if(waited > lp->lp_max_wait_nsecs){
+				lp->lp_max_wait_nsecs = waited;
+			}
+		}
+	}
+	gettime(&lp->lp_hold_secs, &lp->lp_hold_nsecs);
+}
+
+
+void lockprof_released(struct lockprof *lp){
+
+	uint32_t held;
+
+	if(!lockprof_enabled || (lp->lp_hold_secs == 0 &&
+			lp->lp_hold_nsecs == 0)){
+		return;
+	}
+
+	held = lockprof_since(lp->lp_hold_secs, lp->lp_hold_nsecs);
+	if(held > lp->lp_max_hold_nsecs){
+		lp->lp_max_hold_nsecs = held;
+	}
+	lp->lp_hold_secs = 0;
+	lp->lp_hold_nsecs = 0;
+}
+
+
+/*
+ * Copy out the N most contended records under the list lock, then
+ * print them without it, since kprintf may sleep. The names are
+ * copied too, as a lock may be destroyed in between.
+ */
+void lockprof_printstats(unsigned n){
+
+	struct {
+		struct lockprof lp;
+		char name[LOCKPROF_NAMELEN];
+	} top[LOCKPROF_MAXTOP];
+	struct lockprof *lp;
+	unsigned ntop = 0, i, j;
+
+	if(n > LOCKPROF_MAXTOP){
+		n = LOCKPROF_MAXTOP;
+	}
+
+	spinlock_acquire(&lockprof_listlock);
+	for(lp = lockprof_list; lp != NULL; lp = lp->lp_next){
+		if(lp->lp_contended == 0){
+			continue;
+		}
+
+		/* Insertion into top[], kept sorted by contention. */
+		i = ntop < n ? ntop++ : n;
+		while(i > 0 && top[i-1].lp.lp_contended < lp->lp_contended){
+			if(i < n){
+				top[i] = top[i-1];
+			}
+			i--;
+		}
+		if(i < n){
+			top[i].lp = *lp;
+			for(j=0; j<LOCKPROF_NAMELEN-1 && lp->lp_name[j]; j++){
+				top[i].name[j] = lp->lp_name[j];
+			}
+			top[i].name[j] = 0;
+		}
+	}
+	spinlock_release(&lockprof_listlock);
+
+	kprintf("%-20s %-8s %9s %9s %12s %10s %10s\n", "name", "kind",
+			"acquires", "contended", "wait ns", "max wait",
+			"max hold");
+	for(i=0; i<ntop; i++){
+		lp = &top[i].lp;
+		kprintf("%-20s %-8s %9u %9u %12llu %10u %10u\n",
+				top[i].name, lp->lp_kind,
+				lp->lp_acquires, lp->lp_contended,
+				(unsigned long long)lp->lp_wait_nsecs,
+				lp->lp_max_wait_nsecs, lp->lp_max_hold_nsecs);
+	}
+	if(ntop == 0){
+		kprintf("No contended locks.\n");
+	}
+}
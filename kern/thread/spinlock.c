@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockprof.h>
 
 /*
  * Spinlocks.
@@ -50,6 +51,9 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKPROF
+	lk->lk_prof = NULL;
+#endif
 }
 
 /*
@@ -60,6 +64,13 @@ spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_unregister(lk->lk_prof);
+		kfree(lk->lk_prof);
+		lk->lk_prof = NULL;
+	}
+#endif
 }
 
 /*
@@ -73,6 +84,11 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKPROF
+	bool contended = false;
+	time_t secs = 0;
+	uint32_t nsecs = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +103,13 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL && spinlock_data_get(&lk->lk_lock) != 0) {
+		contended = true;
+		lockprof_now(&secs, &nsecs);
+	}
+#endif
+
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -108,6 +131,12 @@ spinlock_acquire(struct spinlock *lk)
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_acquired(lk->lk_prof, contended, secs, nsecs);
+	}
+#endif
 }
 
 /*
@@ -121,6 +150,12 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_released(lk->lk_prof);
+	}
+#endif
+
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
@@ -38,6 +38,7 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
 #include <spl.h>
 ////////////////////////////////////////////////////////////
@@ -147,6 +148,14 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How long a thread spins on a held lock before going to sleep. Each
+ * round polls lk_holder LOCK_SPIN_POLLS times without the spinlock,
+ * then rechecks that the holder is still running elsewhere.
+ */
+#define LOCK_SPIN_ROUNDS	8
+#define LOCK_SPIN_POLLS		64
+
 struct lock *
 lock_create(const char *name)
 {
@@ -163,17 +172,19 @@ lock_create(const char *name)
                 return NULL;
         }
         
-        // add stuff here as needed
-        lock->lk_holder = NULL;
-        
-        spinlock_data_set(&lock->lk_lock, 0);
-
         lock->lk_wchan = wchan_create(lock->lk_name);
-        	if (lock->lk_wchan == NULL) {
-        		kfree(lock->lk_name);
-        		kfree(lock);
-        		return NULL;
-        	}
+        if (lock->lk_wchan == NULL) {
+        	kfree(lock->lk_name);
+        	kfree(lock);
+        	return NULL;
+        }
+
+        spinlock_init(&lock->lk_lock);
+        lock->lk_holder = NULL;
+        lock->lk_waiters = 0;
+#if OPT_LOCKPROF
+        lockprof_register(&lock->lk_prof, "lock", lock->lk_name);
+#endif
 
         return lock;
 }
@@ -182,54 +193,111 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
-
-        KASSERT(spinlock_data_get(&lock->lk_lock) == 0);
-
-        // add stuff here as needed
-        kfree(lock->lk_wchan);
+        KASSERT(lock->lk_holder == NULL);
+        KASSERT(lock->lk_waiters == 0);
+
+#if OPT_LOCKPROF
+        lockprof_unregister(&lock->lk_prof);
+#endif
+        spinlock_cleanup(&lock->lk_lock);
+        wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
         kfree(lock);
 }
 
+/*
+ * True if HOLDER is on cpu right now, somewhere other than here, so
+ * it is likely to release the lock soon. Call with lk_lock held so
+ * HOLDER cannot go away underneath us.
+ */
+static
+bool
+lock_holder_running(struct thread *holder)
+{
+	struct cpu *c = holder->t_cpu;
+
+	return c != curcpu->c_self && c->c_curthread == holder;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
-	if(lock->lk_holder != curthread)
-	{
-		splraise(0, 1);
-		while (spinlock_data_testandset(&lock->lk_lock) != 0) {
-			wchan_lock(lock->lk_wchan);
-			wchan_sleep(lock->lk_wchan);
-		}
-		lock->lk_holder = curthread;
-		spllower(1, 0);
-	}
-	else
-	{
+	struct thread *holder;
+	unsigned rounds = 0;
+#if OPT_LOCKPROF
+	bool contended = false;
+	time_t secs = 0;
+	uint32_t nsecs = 0;
+#endif
+
+	KASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	if (lock->lk_holder == curthread) {
 		panic("Deadlock. Same thread trying to acquire lock twice");
 	}
+
+	spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKPROF
+	if (lock->lk_holder != NULL) {
+		contended = true;
+		lockprof_now(&secs, &nsecs);
+	}
+#endif
+	while ((holder = lock->lk_holder) != NULL) {
+		if (rounds < LOCK_SPIN_ROUNDS && lock_holder_running(holder)) {
+			/* Spin with interrupts on and the spinlock dropped. */
+			spinlock_release(&lock->lk_lock);
+			for (int i=0; i<LOCK_SPIN_POLLS; i++) {
+				if (lock->lk_holder != holder) {
+					break;
+				}
+			}
+			rounds++;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+
+		/*
+		 * Same bridge as in P: lock the wchan before dropping
+		 * lk_lock so a release in between cannot miss us.
+		 */
+		lock->lk_waiters++;
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+		wchan_sleep(lock->lk_wchan);
+
+		spinlock_acquire(&lock->lk_lock);
+		KASSERT(lock->lk_waiters > 0);
+		lock->lk_waiters--;
+	}
+	lock->lk_holder = curthread;
+#if OPT_LOCKPROF
+	lockprof_acquired(&lock->lk_prof, contended, secs, nsecs);
+#endif
+	spinlock_release(&lock->lk_lock);
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
-		lock->lk_holder = NULL;
-		splraise(0, 1);
-		spinlock_data_set(&lock->lk_lock, 0);
-		spllower(1, 0);
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKPROF
+	lockprof_released(&lock->lk_prof);
+#endif
+	lock->lk_holder = NULL;
+	if (lock->lk_waiters > 0) {
 		wchan_wakeone(lock->lk_wchan);
+	}
+	spinlock_release(&lock->lk_lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
-		int do_i_hold;
-		splraise(0, 1);
-		do_i_hold = (lock->lk_holder == curthread);
-		spllower(1, 0);
-		return do_i_hold;
+	return (lock->lk_holder == curthread);
 }
 
 bool
@@ -268,6 +336,10 @@ cv_create(const char *name)
         	return NULL;
         }
 
+#if OPT_LOCKPROF
+        lockprof_register(&cv->cv_prof, "cv", cv->cv_name);
+#endif
+
         return cv;
 }
 
@@ -275,7 +347,9 @@ void
 cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
-        // add stuff here as needed
+#if OPT_LOCKPROF
+        lockprof_unregister(&cv->cv_prof);
+#endif
         wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
         kfree(cv);
@@ -284,14 +358,22 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
+#if OPT_LOCKPROF
+		time_t secs;
+		uint32_t nsecs;
 
+		lockprof_now(&secs, &nsecs);
+#endif
 		wchan_lock(cv->cv_wchan);
 		splraise(0, 1);
 		lock_release(lock);
 		spllower(1, 0);
 		wchan_sleep(cv->cv_wchan);
 		lock_acquire(lock);
+#if OPT_LOCKPROF
+		/* Every wait counts as contended; see lockprof.h. */
+		lockprof_acquired(&cv->cv_prof, true, secs, nsecs);
+#endif
 
 }
 
@@ -331,54 +413,143 @@ struct rwlock * rwlock_create(const char * name)
 		return NULL;
 	}
 
-	// add stuff here as needed
-	rwlock->lock = lock_create(name);
-	if(rwlock->lock == NULL){
+	rwlock->rw_rwchan = wchan_create(rwlock->rwlock_name);
+	if(rwlock->rw_rwchan == NULL){
 		kfree(rwlock->rwlock_name);
 		kfree(rwlock);
 		return NULL;
 	}
 
-	rwlock->sem = sem_create(name,100);
-	if(rwlock->sem == NULL){
-		kfree(rwlock->lock);
+	rwlock->rw_wwchan = wchan_create(rwlock->rwlock_name);
+	if(rwlock->rw_wwchan == NULL){
+		wchan_destroy(rwlock->rw_rwchan);
 		kfree(rwlock->rwlock_name);
 		kfree(rwlock);
 		return NULL;
 	}
 
+	spinlock_init(&rwlock->rw_lock);
+	rwlock->rw_readers = 0;
+	rwlock->rw_writer = NULL;
+	rwlock->rw_waitreaders = 0;
+	rwlock->rw_waitwriters = 0;
+	rwlock->rw_upgrading = false;
+
 	return	rwlock;
 }
 
 void rwlock_destroy(struct rwlock * rwlock)
 {
 	KASSERT(rwlock != NULL);
+	KASSERT(rwlock->rw_readers == 0);
+	KASSERT(rwlock->rw_writer == NULL);
+	KASSERT(rwlock->rw_waitreaders == 0 && rwlock->rw_waitwriters == 0);
 
-	kfree(rwlock->sem);
-	kfree(rwlock->lock);
+	spinlock_cleanup(&rwlock->rw_lock);
+	wchan_destroy(rwlock->rw_wwchan);
+	wchan_destroy(rwlock->rw_rwchan);
 	kfree(rwlock->rwlock_name);
 	kfree(rwlock);
 }
 
+/*
+ * Sleep on WC with rw_lock held, bridging through the wchan lock as P
+ * does. Returns with rw_lock held again.
+ */
+static
+void
+rwlock_sleep(struct rwlock *rwlock, struct wchan *wc)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	wchan_lock(wc);
+	spinlock_release(&rwlock->rw_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&rwlock->rw_lock);
+}
+
 void rwlock_acquire_read(struct rwlock * rwlock)
 {
-	lock_acquire(rwlock->lock);
-	P(rwlock->sem);
-	lock_release(rwlock->lock);
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rw_lock);
+	KASSERT(rwlock->rw_writer != curthread);
+	while(rwlock->rw_writer != NULL || rwlock->rw_waitwriters > 0 ||
+			rwlock->rw_upgrading) {
+		rwlock->rw_waitreaders++;
+		rwlock_sleep(rwlock, rwlock->rw_rwchan);
+		rwlock->rw_waitreaders--;
+	}
+	rwlock->rw_readers++;
+	spinlock_release(&rwlock->rw_lock);
 }
 
 void rwlock_release_read(struct rwlock * rwlock)
 {
-	V(rwlock->sem);
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rw_lock);
+	KASSERT(rwlock->rw_readers > 0);
+	rwlock->rw_readers--;
+	if(rwlock->rw_upgrading){
+		/* The upgrader is the last reader left; let it through. */
+		if(rwlock->rw_readers == 1){
+			wchan_wakeall(rwlock->rw_wwchan);
+		}
+	}else if(rwlock->rw_readers == 0 && rwlock->rw_waitwriters > 0){
+		wchan_wakeone(rwlock->rw_wwchan);
+	}
+	spinlock_release(&rwlock->rw_lock);
 }
 
 void rwlock_acquire_write(struct rwlock * rwlock)
 {
-	lock_acquire(rwlock->lock);
-	while(rwlock->sem->sem_count < 100) {}
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rw_lock);
+	KASSERT(rwlock->rw_writer != curthread);
+	while(rwlock->rw_writer != NULL || rwlock->rw_readers > 0 ||
+			rwlock->rw_upgrading) {
+		rwlock->rw_waitwriters++;
+		rwlock_sleep(rwlock, rwlock->rw_wwchan);
+		rwlock->rw_waitwriters--;
+	}
+	rwlock->rw_writer = curthread;
+	spinlock_release(&rwlock->rw_lock);
 }
 
 void rwlock_release_write(struct rwlock * rwlock)
 {
-	lock_release(rwlock->lock);
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rw_lock);
+	KASSERT(rwlock->rw_writer == curthread);
+	rwlock->rw_writer = NULL;
+	if(rwlock->rw_waitwriters > 0){
+		wchan_wakeone(rwlock->rw_wwchan);
+	}else if(rwlock->rw_waitreaders > 0){
+		wchan_wakeall(rwlock->rw_rwchan);
+	}
+	spinlock_release(&rwlock->rw_lock);
+}
+
+bool rwlock_try_upgrade(struct rwlock * rwlock)
+{
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rw_lock);
+	KASSERT(rwlock->rw_readers > 0);
+	if(rwlock->rw_upgrading){
+		spinlock_release(&rwlock->rw_lock);
+		return false;
+	}
+	rwlock->rw_upgrading = true;
+	while(rwlock->rw_readers > 1){
+		rwlock_sleep(rwlock, rwlock->rw_wwchan);
+	}
+	rwlock->rw_readers = 0;
+	rwlock->rw_upgrading = false;
+	rwlock->rw_writer = curthread;
+	spinlock_release(&rwlock->rw_lock);
+	return true;
 }
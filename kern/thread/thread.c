@@ -45,6 +45,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <file_syscalls.h>
@@ -52,6 +53,7 @@
 
 #include "opt-synchprobs.h"
 #include "opt-defaultscheduler.h"
+#include "opt-dumbvm.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +74,8 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static bool thread_steal(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -153,6 +157,12 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_readysince = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_lastrun = 0;
+	thread->t_lastmigrate = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -166,9 +176,8 @@ thread_create(const char *name)
 	thread->t_cwd = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
-	for(int i=3; i<__OPEN_MAX; i++){
-		thread->t_fdtable[i] = NULL;
-	}
+	thread->t_fdtable = NULL;
+	thread->t_vforksem = NULL;
 
 	return thread;
 }
@@ -199,13 +208,21 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_npagecache = 0;
+	c->c_tlbas = NULL;
+	c->c_tlbpid = 0;
+	c->c_asidgen = 1;
+	c->c_nextasid = 1;
 
+	c->c_loadavg = 0;
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_taken = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -261,11 +278,8 @@ thread_destroy(struct thread *thread)
 	 * If you add things to struct thread, be sure to clean them up
 	 * either here or in thread_exit(). (And not both...)
 	 */
-	/*if(thread->t_fdtable!=NULL)
-	{
-		kfree(thread->t_fdtable);
-	}
-	KASSERT(thread->t_fdtable == NULL);*/
+	/* Descriptors, closed in thread_exit */
+	KASSERT(thread->t_fdtable == NULL);
 
 	/* VFS fields, cleaned up in thread_exit */
 	KASSERT(thread->t_cwd == NULL);
@@ -460,6 +474,66 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+#if OPT_DEFAULTSCHEDULER
+/*
+ * Put a thread on a cpu's run queue, whose lock must be held.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	threadlist_addtail(&c->c_runqueue, t);
+}
+#else
+/*
+ * Multilevel feedback queue. The run queue is kept sorted by
+ * t_priority, round-robin within a level, so taking the head picks
+ * the most important thread and migration (which takes from the
+ * tail) gives away the least important ones.
+ *
+ * A thread that uses up its quantum drops a level; lower levels get
+ * longer quanta. A thread that sleeps moves up a level, which favors
+ * interactive jobs. Threads that have waited MLFQ_AGE_HARDCLOCKS on
+ * the run queue move up a level too, so nothing starves.
+ */
+#define MLFQ_LEVELS		4
+#define MLFQ_QUANTUM(level)	(1U << (level))	/* In hardclocks */
+#define MLFQ_AGE_HARDCLOCKS	50
+
+/*
+ * Insert a thread in a cpu's run queue, whose lock must be held,
+ * behind every thread at its level or above.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	/* Walk back from the tail; the head bookend has no tln_prev. */
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Put a thread that has just become ready on a cpu's run queue, and
+ * start its wait for aging.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	t->t_readysince = c->c_hardclocks;
+	runqueue_insert(c, t);
+}
+#endif
+
 /*
  * Make a thread runnable.
  *
@@ -484,7 +558,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -541,6 +615,15 @@ thread_fork(const char *name,
 	}
 	thread_checkstack_init(newthread);
 
+	/* Descriptors are copied; the open files behind them are shared. */
+	if (curthread->t_fdtable != NULL) {
+		newthread->t_fdtable = fdtable_copy(curthread->t_fdtable);
+		if (newthread->t_fdtable == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+	}
+
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
@@ -564,14 +647,6 @@ thread_fork(const char *name,
 	 */
 	newthread->t_iplhigh_count++;
 
-	// Copying File Descriptor table
-	for(int i=0; i<__OPEN_MAX; i++){
-		newthread->t_fdtable[i] = curthread->t_fdtable[i];
-		if(newthread->t_fdtable[i]!=NULL){
-			newthread->t_fdtable[i]->ref_count++;
-		}
-	}
-
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
@@ -650,6 +725,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+	/* Remember where and when it ran, for migration. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	case S_RUN:
@@ -659,6 +738,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	case S_SLEEP:
+#if !OPT_DEFAULTSCHEDULER
+		/* Gave up the cpu before its quantum ran out: boost. */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
+#endif
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -706,6 +792,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+
+			/* Look for work elsewhere before giving up. */
+			if (thread_steal()) {
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				continue;
+			}
+#if !OPT_DUMBVM
+			/*
+			 * Pre-zero some free pages before going to sleep,
+			 * then check the runqueue again. A wakeup posted
+			 * meanwhile leaves an interrupt pending, so it can't
+			 * get lost.
+			 */
+			if (vm_zero_idle()) {
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				continue;
+			}
+#endif
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
@@ -859,12 +963,10 @@ thread_exit(void)
 
 	cur = curthread;
 
-	if (cur->t_fdtable){
-		for(int i=0; i<__OPEN_MAX; i++){
-			if(curthread->t_fdtable[i] == NULL){
-				curthread->t_fdtable[i] = NULL;
-			}
-		}
+	/* Close our descriptors */
+	if (cur->t_fdtable) {
+		fdtable_destroy(cur->t_fdtable);
+		cur->t_fdtable = NULL;
 	}
 
 	/* VFS fields */
@@ -874,7 +976,13 @@ thread_exit(void)
 	}
 
 	/* VM fields */
-	if (cur->t_addrspace) {
+	if (cur->t_vforksem != NULL) {
+		/* Borrowed; hand it back to the vfork parent. */
+		cur->t_addrspace = NULL;
+		as_activate(NULL);
+		vfork_release();
+	}
+	else if (cur->t_addrspace) {
 		/*
 		 * Clear t_addrspace before calling as_destroy. Otherwise
 		 * if as_destroy sleeps (which is quite possible) when we
@@ -933,12 +1041,97 @@ schedule(void)
 {
 	// 28 Feb 2012 : GWA : Leave the default scheduler alone!
 }
+
+void
+thread_tick(void)
+{
+	thread_yield();
+}
 #else
+/*
+ * Age the run queue: anything that has been waiting too long moves up
+ * a level.
+ */
 void
 schedule(void)
 {
-	// 28 Feb 2012 : GWA : Implement your scheduler that prioritizes
-	// "interactive" threads here.
+	struct threadlist aged;
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned now;
+	bool changed = false;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	now = curcpu->c_hardclocks;
+	for (tln = curcpu->c_runqueue.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		if (t->t_priority > 0 &&
+		    now - t->t_readysince >= MLFQ_AGE_HARDCLOCKS) {
+			t->t_priority--;
+			t->t_ticks = 0;
+			t->t_readysince = now;
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		/*
+		 * Re-sort. The queue is short; just reinsert everything,
+		 * keeping everyone's wait so far.
+		 */
+		threadlist_init(&aged);
+		while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+			threadlist_addtail(&aged, t);
+		}
+		while ((t = threadlist_remhead(&aged)) != NULL) {
+			runqueue_insert(curcpu->c_self, t);
+		}
+		threadlist_cleanup(&aged);
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Charge the current thread a hardclock. Once it has used its whole
+ * quantum it drops a level and yields; before that it is preempted
+ * only if something more important is waiting.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	struct thread *next;
+	bool preempt = false;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	/* The idle loop isn't charged to whoever is curthread. */
+	if (curcpu->c_isidle) {
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= MLFQ_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < MLFQ_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		preempt = next->t_priority < cur->t_priority;
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 #endif
 
@@ -951,117 +1144,185 @@ schedule(void)
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So:
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ *   - CPUs are compared by a decaying average of their load rather
+ *     than the run queue length at this instant, and only one CPU's
+ *     run queue (our own) is looked at;
+ *   - threads move only when this CPU is ahead of the least loaded
+ *     one by LOAD_IMBALANCE, and only enough of them to even things
+ *     out, so two CPUs a thread apart don't trade it back and forth;
+ *   - threads that ran here within CACHE_HOT_HARDCLOCKS, or were
+ *     migrated within MIGRATE_COOLDOWN_HARDCLOCKS, stay put.
  */
+#define LOAD_SCALE			256
+#define LOAD_IMBALANCE			(2 * LOAD_SCALE)
+#define CACHE_HOT_HARDCLOCKS		8
+#define MIGRATE_COOLDOWN_HARDCLOCKS	64
+
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
+	unsigned mine, load, lowest, sample, to_send, now;
 	unsigned i, numcpus;
-	struct cpu *c;
+	struct cpu *c, *target;
 	struct threadlist victims;
+	struct threadlistnode *tln, *prev;
 	struct thread *t;
 
-	my_count = total_count = 0;
+	now = curcpu->c_hardclocks;
+
+	/* Fold this period's sample into our own load average. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	sample = curcpu->c_runqueue.tl_count + (curcpu->c_isidle ? 0 : 1);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	curcpu->c_loadavg = (curcpu->c_loadavg * 7 + sample * LOAD_SCALE) / 8;
+	mine = curcpu->c_loadavg;
+
+	/* Find the least loaded other cpu. Stale reads are fine here. */
+	target = NULL;
+	lowest = mine;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		load = c->c_loadavg;
+		if (c != curcpu->c_self && load < lowest) {
+			lowest = load;
+			target = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (target == NULL || mine - lowest < LOAD_IMBALANCE) {
 		return;
 	}
+	to_send = (mine - lowest) / LOAD_IMBALANCE;
 
-	to_send = my_count - one_share;
+	/*
+	 * Take cold threads from the tail of our run queue (the least
+	 * important ones, under the MLFQ scheduler).
+	 */
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	for (tln = curcpu->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_prev != NULL && victims.tl_count < to_send;
+	     tln = prev) {
+		prev = tln->tln_prev;
+		t = tln->tln_self;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can if it went to sleep, the
+		 * processor idled, and it was reawakened before the
+		 * processor fully unidled. Migrating curthread can
+		 * cause bad things to happen, so skip it.
+		 */
+		if (t == curthread) {
+			continue;
+		}
+		if (t->t_lastcpu == curcpu->c_self &&
+		    now - t->t_lastrun < CACHE_HOT_HARDCLOCKS) {
+			continue;
+		}
+		if (t->t_lastmigrate != 0 &&
+		    now - t->t_lastmigrate < MIGRATE_COOLDOWN_HARDCLOCKS) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-					"Migrated thread %s: cpu %u -> %u",
-					t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		threadlist_addtail(&victims, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (threadlist_isempty(&victims)) {
+		threadlist_cleanup(&victims);
+		return;
+	}
+
+	spinlock_acquire(&target->c_runqueue_lock);
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		t->t_cpu = target;
+		t->t_lastmigrate = now;
+		runqueue_add(target, t);
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, target->c_number);
+	}
+	if (target->c_isidle) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(target, IPI_UNIDLE);
+	}
+	spinlock_release(&target->c_runqueue_lock);
+
+	threadlist_cleanup(&victims);
+}
+
+/*
+ * Work stealing.
+ *
+ * Called from the idle loop, with no locks held, when this CPU's run
+ * queue is empty. Takes the first thread off the longest run queue
+ * elsewhere, so a newly runnable thread doesn't have to wait for the
+ * busy CPU's next thread_consider_migration. The queue lengths are
+ * read without locking to pick the victim; only its lock is taken.
+ *
+ * Returns true if a thread was put on our run queue.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i, count, most;
+
+	victim = NULL;
+	most = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		count = c->c_runqueue.tl_count;
+		if (c != curcpu->c_self && count > most) {
+			most = count;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return false;
 	}
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * Holding the victim's run queue lock means every thread on
+	 * its queue is fully switched out, except possibly its
+	 * curthread (see thread_consider_migration), which we leave.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	t = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (tln = victim->c_runqueue.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self != victim->c_curthread) {
+			t = tln->tln_self;
+			threadlist_remove(&victim->c_runqueue, t);
+			t->t_cpu = curcpu->c_self;
+			break;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	if (t == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	t->t_lastmigrate = curcpu->c_hardclocks;
+	runqueue_add(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return true;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1247,10 +1508,11 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
+	unsigned ticket;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
@@ -1258,20 +1520,82 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
-	else {
+	else if (n != TLBSHOOTDOWN_ALL) {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
 
+	/* This lands in the next batch the target takes. */
+	ticket = target->c_shootdown_taken + 1;
+
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+/*
+ * Wait for TARGET to finish the shootdown batch holding TICKET.
+ *
+ * We can be preempted and moved while waiting, even onto TARGET
+ * itself. That is fine: interrupts are on between polls, so TARGET's
+ * pending IPI is taken on this cpu and the wait completes as usual.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	bool done;
+
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_shootdown_done - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
+}
+
+void
+ipi_tlbshootdown_cpus(uint32_t cpumask, const struct tlbshootdown *mapping)
+{
+	unsigned tickets[MAXCPUS];
+	unsigned i;
+	struct cpu *c;
+	int spl;
+
+	/* Stay on this cpu until every shootdown is queued. */
+	spl = splhigh();
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((cpumask & ((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		if (c == curcpu->c_self) {
+			vm_tlbshootdown(mapping);
+			cpumask &= ~((uint32_t)1 << c->c_number);
+		}
+		else {
+			tickets[c->c_number] = ipi_tlbshootdown(c, mapping);
+		}
+	}
+	splx(spl);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (cpumask & ((uint32_t)1 << c->c_number)) {
+			ipi_tlbshootdown_wait(c, tickets[c->c_number]);
+		}
+	}
 }
 
 void
 interprocessor_interrupt(void)
 {
+	struct tlbshootdown shootdown[TLBSHOOTDOWN_MAX];
+	int numshootdown = 0;
+	unsigned batch = 0;
 	uint32_t bits;
 	int i;
 
@@ -1300,17 +1624,34 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
-			vm_tlbshootdown_all();
-		}
-		else {
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
-			}
+		/*
+		 * Take the queued shootdowns and do them after
+		 * dropping the IPI lock, so the VM system is free to
+		 * take its own locks.
+		 */
+		numshootdown = curcpu->c_numshootdown;
+		for (i=0; i<numshootdown; i++) {
+			shootdown[i] = curcpu->c_shootdown[i];
 		}
 		curcpu->c_numshootdown = 0;
+		batch = ++curcpu->c_shootdown_taken;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		if (numshootdown == TLBSHOOTDOWN_ALL) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<numshootdown; i++) {
+				vm_tlbshootdown(&shootdown[i]);
+			}
+		}
+
+		spinlock_acquire(&curcpu->c_ipi_lock);
+		curcpu->c_shootdown_done = batch;
+		spinlock_release(&curcpu->c_ipi_lock);
+	}
 }
@@ -0,0 +1,509 @@
+/*
+ * pipe.c
+ *
+ *  Pipes. The two ends are vnodes sharing a ring buffer of PIPE_SIZE
+ *  bytes, so pipe descriptors go through the same fhandle and VOP_READ
+ *  and VOP_WRITE paths as files.
+ *
+ *  The pipe state is under a spinlock, but data is copied to and from
+ *  the user without it: one reader and one writer at a time own the
+ *  pipe (p_rbusy, p_wbusy), and each copies only the part of the ring
+ *  the other can't touch, the bytes in the pipe for the reader and the
+ *  free space for the writer. p_head and p_tail count all bytes ever
+ *  written and read, so p_head - p_tail is the number in the pipe.
+ *
+ *  Readers and writers sleep on separate wait channels. A writer wakes
+ *  readers once per batch it copies in; a reader wakes writers only
+ *  once PIPE_WAKE_SPACE bytes are free, not on every byte.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stattypes.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <pipe.h>
+
+#define PIPE_WAKE_SPACE (PIPE_SIZE / 4)
+
+struct pipe {
+	struct spinlock p_lock;
+	struct wchan *p_rwchan;		/* readers, for data or p_rbusy */
+	struct wchan *p_wwchan;		/* writers, for space or p_wbusy */
+	unsigned p_rsleepers;		/* how many are on each */
+	unsigned p_wsleepers;
+	char *p_buf;
+	unsigned p_head;		/* bytes ever written */
+	unsigned p_tail;		/* bytes ever read */
+	bool p_rbusy;			/* a reader is copying out */
+	bool p_wbusy;			/* a writer is copying in */
+	bool p_readers;			/* read end still open */
+	bool p_writers;			/* write end still open */
+	struct vnode p_rvn;		/* the two ends */
+	struct vnode p_wvn;
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+/*
+ * Sleep on WC, giving up p_lock meanwhile. SLEEPERS counts who is on
+ * it so wakeups can be skipped when nobody is.
+ */
+static
+void
+pipe_sleep(struct pipe *p, struct wchan *wc, unsigned *sleepers)
+{
+	(*sleepers)++;
+	wchan_lock(wc);
+	spinlock_release(&p->p_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&p->p_lock);
+	(*sleepers)--;
+}
+
+/*
+ * Copy LEN bytes between the ring at byte count POS and UIO, in two
+ * pieces if they wrap.
+ */
+static
+int
+pipe_uiomove(struct pipe *p, unsigned pos, size_t len, struct uio *uio)
+{
+	unsigned start = pos % PIPE_SIZE;
+	size_t first;
+	int result;
+
+	first = len < PIPE_SIZE - start ? len : PIPE_SIZE - start;
+	result = uiomove(p->p_buf + start, first, uio);
+	if (result == 0 && len > first) {
+		result = uiomove(p->p_buf, len - first, uio);
+	}
+	return result;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t len, resid;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	if (v != &p->p_rvn) {
+		return EBADF;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	while (p->p_rbusy || (p->p_head == p->p_tail && p->p_writers)) {
+		pipe_sleep(p, p->p_rwchan, &p->p_rsleepers);
+	}
+	if (p->p_head == p->p_tail) {
+		/* Empty and no writers: EOF */
+		spinlock_release(&p->p_lock);
+		return 0;
+	}
+	p->p_rbusy = true;
+	len = p->p_head - p->p_tail;
+	spinlock_release(&p->p_lock);
+
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	resid = uio->uio_resid;
+	result = pipe_uiomove(p, p->p_tail, len, uio);
+
+	spinlock_acquire(&p->p_lock);
+	p->p_tail += resid - uio->uio_resid;
+	p->p_rbusy = false;
+	if (p->p_wsleepers > 0 &&
+	    PIPE_SIZE - (p->p_head - p->p_tail) >= PIPE_WAKE_SPACE) {
+		wchan_wakeall(p->p_wwchan);
+	}
+	if (p->p_rsleepers > 0 &&
+	    (p->p_head != p->p_tail || !p->p_writers)) {
+		wchan_wakeall(p->p_rwchan);
+	}
+	spinlock_release(&p->p_lock);
+
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t len, resid;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	if (v != &p->p_wvn) {
+		return EBADF;
+	}
+
+	/* Holding p_wbusy for the whole call keeps writes from mixing. */
+	spinlock_acquire(&p->p_lock);
+	while (p->p_wbusy && p->p_readers) {
+		pipe_sleep(p, p->p_wwchan, &p->p_wsleepers);
+	}
+	p->p_wbusy = true;
+
+	while (uio->uio_resid > 0) {
+		while (p->p_head - p->p_tail == PIPE_SIZE && p->p_readers) {
+			pipe_sleep(p, p->p_wwchan, &p->p_wsleepers);
+		}
+		if (!p->p_readers) {
+			result = EPIPE;
+			break;
+		}
+		len = PIPE_SIZE - (p->p_head - p->p_tail);
+		spinlock_release(&p->p_lock);
+
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		resid = uio->uio_resid;
+		result = pipe_uiomove(p, p->p_head, len, uio);
+
+		spinlock_acquire(&p->p_lock);
+		p->p_head += resid - uio->uio_resid;
+		if (p->p_rsleepers > 0) {
+			wchan_wakeall(p->p_rwchan);
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	p->p_wbusy = false;
+	if (p->p_wsleepers > 0) {
+		wchan_wakeall(p->p_wwchan);
+	}
+	spinlock_release(&p->p_lock);
+
+	return result;
+}
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	wchan_destroy(p->p_rwchan);
+	wchan_destroy(p->p_wwchan);
+	spinlock_cleanup(&p->p_lock);
+	kfree(p->p_buf);
+	kfree(p);
+}
+
+/*
+ * Called when the last reference to an end goes away. Whoever is
+ * waiting on the other end finds out; the pipe goes with the second
+ * end.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool last;
+
+	/*
+	 * Done with V first: once its end is marked closed, a reclaim of
+	 * the other end may free the pipe, V included.
+	 */
+	VOP_CLEANUP(v);
+
+	spinlock_acquire(&p->p_lock);
+	if (v == &p->p_rvn) {
+		p->p_readers = false;
+		wchan_wakeall(p->p_wwchan);
+	}
+	else {
+		p->p_writers = false;
+		wchan_wakeall(p->p_rwchan);
+	}
+	last = !p->p_readers && !p->p_writers;
+	spinlock_release(&p->p_lock);
+
+	if (last) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	/* Pipes have no names, so they are never opened by path. */
+	(void)v;
+	(void)flags;
+	return EINVAL;
+}
+
+static
+int
+pipe_close(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_SIZE;
+
+	spinlock_acquire(&p->p_lock);
+	statbuf->st_size = p->p_head - p->p_tail;
+	spinlock_release(&p->p_lock);
+
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+/*
+ * Used for several functions with the same type signature that are
+ * not meaningful on pipes.
+ */
+static
+int
+pipe_badio(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return EINVAL;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+/* For remove and rmdir. */
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v1, const char *n1,
+	    struct vnode *v2, const char *n2)
+{
+	(void)v1;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *pathname, struct vnode **result)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *pathname, struct vnode **result,
+		char *buf, size_t len)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_badio,   /* readlink */
+	pipe_badio,   /* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_badio,   /* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,  /* remove */
+	pipe_nameop,  /* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
+
+int
+pipe_create(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *p;
+
+	p = kmalloc(sizeof(struct pipe));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	p->p_buf = kmalloc(PIPE_SIZE);
+	if (p->p_buf == NULL) {
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_rwchan = wchan_create("pipe reader");
+	if (p->p_rwchan == NULL) {
+		kfree(p->p_buf);
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_wwchan = wchan_create("pipe writer");
+	if (p->p_wwchan == NULL) {
+		wchan_destroy(p->p_rwchan);
+		kfree(p->p_buf);
+		kfree(p);
+		return ENOMEM;
+	}
+
+	spinlock_init(&p->p_lock);
+	p->p_rsleepers = 0;
+	p->p_wsleepers = 0;
+	p->p_head = 0;
+	p->p_tail = 0;
+	p->p_rbusy = false;
+	p->p_wbusy = false;
+	p->p_readers = true;
+	p->p_writers = true;
+
+	VOP_INIT(&p->p_rvn, &pipe_vnode_ops, NULL, p);
+	VOP_INIT(&p->p_wvn, &pipe_vnode_ops, NULL, p);
+
+	/* Open, as vfs_open would leave them. */
+	VOP_INCOPEN(&p->p_rvn);
+	VOP_INCOPEN(&p->p_wvn);
+
+	*readvn = &p->p_rvn;
+	*writevn = &p->p_wvn;
+	return 0;
+}
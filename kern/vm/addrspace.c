@@ -31,6 +31,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <addrspace.h>
+#include <vnode.h>
 #include <vm.h>
 
 /*
@@ -39,13 +40,13 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
-vaddr_t as_reset_rw_permission(vaddr_t *vadd);
-vaddr_t as_set_rw_permission(vaddr_t *vadd);
-
-int get_permissions_int(int r, int w, int x);
 int b(void);
 int ch = 0;
 
+static int as_insert_region(struct addrspace *as, const struct region *rg);
+static void as_remove_region(struct addrspace *as, unsigned i);
+static int as_split_region(struct addrspace *as, vaddr_t vaddr);
+
 struct addrspace *
 as_create(void)
 {
@@ -56,12 +57,18 @@ as_create(void)
 		return NULL;
 	}
 
-	as->pte = NULL;
+	for (int i=0; i<PT_DIR_SIZE; i++) {
+		as->pt_dir[i] = NULL;
+	}
+
+	spinlock_init(&as->as_tlblock);
+	for (int i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	as->as_cpus = 0;
 
-	as->as_vbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_npages2 = 0;
+	as->as_regions = NULL;
+	as->as_nregions = 0;
 	as->hend = 0;
 	as->hstart = 0;
 	as->as_stackvbase = USERSTACK - (VM_STACKPAGES * PAGE_SIZE);
@@ -81,49 +88,33 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 	// copy regions
-	new_as->as_vbase1 = old->as_vbase1;
-	new_as->as_npages1 = old->as_npages1;
-	new_as->as_vbase2 = old->as_vbase2;
-	new_as->as_npages2 = old->as_npages2;
-
-	// copy page table entries
-	struct page_table_entry *oldpteHead = old->pte;
-	if (oldpteHead != NULL)
-	{
-		struct page_table_entry *newpteHead = kmalloc(sizeof(struct page_table_entry));
-		struct page_table_entry *newpteStart = newpteHead;
-
-		newpteHead->va = oldpteHead->va;
-		newpteHead->pa = alloc_userpage(new_as,oldpteHead->va);
-		memmove((void *)PADDR_TO_KVADDR(newpteHead->pa),
-				(const void *)PADDR_TO_KVADDR(oldpteHead->pa),
-				PAGE_SIZE);
-		newpteHead->next=NULL;
-
-		oldpteHead = oldpteHead->next;
-
-		while(oldpteHead != NULL)
-		{
-			struct page_table_entry *newpte = kmalloc(sizeof(struct page_table_entry));
-			newpte->va = oldpteHead->va;
-			newpte->pa = alloc_userpage(new_as,oldpteHead->va);
-			memmove((void *)PADDR_TO_KVADDR(newpte->pa),
-					(const void *)PADDR_TO_KVADDR(oldpteHead->pa),
-					PAGE_SIZE);
-			newpte->next=NULL;
-
-			newpteHead->next=newpte;
-			newpteHead = newpteHead->next;
-
-			oldpteHead = oldpteHead->next;
+	if (old->as_nregions > 0) {
+		new_as->as_regions =
+			kmalloc(old->as_nregions * sizeof(struct region));
+		if (new_as->as_regions == NULL) {
+			as_destroy(new_as);
+			return ENOMEM;
+		}
+		memcpy(new_as->as_regions, old->as_regions,
+				old->as_nregions * sizeof(struct region));
+		new_as->as_nregions = old->as_nregions;
+		for (unsigned i=0; i<new_as->as_nregions; i++) {
+			if (new_as->as_regions[i].rg_vnode != NULL) {
+				VOP_INCREF(new_as->as_regions[i].rg_vnode);
+			}
 		}
-		new_as->pte = newpteStart;
 	}
-	else
-	{
-		//kprintf("\n something wrong :-O");
+
+	// copy page table entries
+	int result = pt_copy(old, new_as);
+	if (result) {
+		as_destroy(new_as);
+		return result;
 	}
 
+	// the parent's writable mappings are read-only now
+	vm_tlb_flush_as(old);
+
 	new_as->hend = old->hend;
 	new_as->hstart = old->hstart;
 	new_as->as_stackvbase = old->as_stackvbase;
@@ -141,18 +132,19 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	struct page_table_entry *pte = as->pte;
-	struct page_table_entry *next = NULL;
-
-	while(pte!=NULL)
-	{
-		next = pte->next;
-
-		free_userpage(pte->va);
-		kfree(pte);
+	/* Detach any cpu that still has us loaded. */
+	vm_tlb_flush_as(as);
 
-		pte = next;
+	pt_destroy(as);
+	for (unsigned i=0; i<as->as_nregions; i++) {
+		if (as->as_regions[i].rg_vnode != NULL) {
+			VOP_DECREF(as->as_regions[i].rg_vnode);
+		}
+	}
+	if (as->as_regions != NULL) {
+		kfree(as->as_regions);
 	}
+	spinlock_cleanup(&as->as_tlblock);
 	kfree(as);
 }
 
@@ -160,8 +152,7 @@ as_destroy(struct addrspace *as)
 void
 as_activate(struct addrspace *as)
 {
-	vm_tlbshootdown_all();
-	(void)as;  // suppress warning until code gets written
+	vm_tlb_activate(as);
 }
 
 
@@ -171,9 +162,9 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Write
+ * permission is checked in vm_fault; the others are kept but the
+ * MIPS TLB can't enforce them.
  */
 
 
@@ -182,6 +173,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		int readable, int writeable, int executable)
 {
 	size_t npages;
+	struct region rg;
+	int result;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -194,15 +187,18 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	//npages+=1;
 
-	int permission = get_permissions_int( readable,  writeable,  executable);
-
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr|permission;
-		as->as_npages1 = npages;
-
-	}else if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr|permission;
-		as->as_npages2 = npages;
+	rg.rg_vbase = vaddr;
+	rg.rg_npages = npages;
+	rg.rg_flags = (readable ? REGION_READ : 0) |
+		(writeable ? REGION_WRITE : 0) |
+		(executable ? REGION_EXEC : 0);
+	rg.rg_type = RG_SEGMENT;
+	rg.rg_vnode = NULL;
+	rg.rg_offset = 0;
+
+	result = as_insert_region(as, &rg);
+	if (result) {
+		return result;
 	}
 
 	if (as->hstart < (vaddr + sz)) {
@@ -212,8 +208,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	as->as_stackvbase = USERSTACK - (VM_STACKPAGES * PAGE_SIZE);
 
-	// KASSERT() - There won't be more than 2 regions
-
 	return 0;
 }
 
@@ -221,8 +215,9 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 int
 as_prepare_load(struct addrspace *as)
 {
-	as_set_rw_permission(&as->as_vbase1);
-	as_set_rw_permission(&as->as_vbase2);
+	for (unsigned i=0; i<as->as_nregions; i++) {
+		as->as_regions[i].rg_flags |= REGION_LOADING;
+	}
 
 	/*vaddr_t vaddr = as->as_vbase1 & PAGE_FRAME;
 	int npages = as->as_npages1;
@@ -296,10 +291,10 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	as_reset_rw_permission(&as->as_vbase1);
-	as_reset_rw_permission(&as->as_vbase2);
+	for (unsigned i=0; i<as->as_nregions; i++) {
+		as->as_regions[i].rg_flags &= ~REGION_LOADING;
+	}
 
-	(void)as;
 	return 0;
 }
 
@@ -327,40 +322,342 @@ int b()
 }
 
 
-int get_permissions_int(int r, int w, int x)
+/*
+ * Binary search of the sorted region array.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned lo = 0, hi = as->as_nregions;
+	unsigned mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rg = &as->as_regions[mid];
+		if (vaddr < rg->rg_vbase) {
+			hi = mid;
+		}
+		else if (vaddr >= rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			lo = mid + 1;
+		}
+		else {
+			return rg;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Insert a copy of RG into the sorted region array, refusing overlaps.
+ */
+static int
+as_insert_region(struct addrspace *as, const struct region *rg)
+{
+	struct region *regions;
+	vaddr_t end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	unsigned i;
+
+	/* Find the insertion point, refusing overlaps. */
+	for (i=0; i<as->as_nregions; i++) {
+		if (as->as_regions[i].rg_vbase >= end) {
+			break;
+		}
+		if (as->as_regions[i].rg_vbase +
+				as->as_regions[i].rg_npages * PAGE_SIZE > rg->rg_vbase) {
+			return EINVAL;
+		}
+	}
+
+	regions = kmalloc((as->as_nregions + 1) * sizeof(struct region));
+	if (regions == NULL) {
+		return ENOMEM;
+	}
+	if (as->as_nregions > 0) {
+		memcpy(regions, as->as_regions, i * sizeof(struct region));
+		memcpy(&regions[i+1], &as->as_regions[i],
+				(as->as_nregions - i) * sizeof(struct region));
+		kfree(as->as_regions);
+	}
+	regions[i] = *rg;
+
+	as->as_regions = regions;
+	as->as_nregions++;
+	return 0;
+}
+
+
+/*
+ * Drop entry I of the region array. The caller has dealt with its
+ * pages and file reference.
+ */
+static void
+as_remove_region(struct addrspace *as, unsigned i)
+{
+	KASSERT(i < as->as_nregions);
+
+	memmove(&as->as_regions[i], &as->as_regions[i+1],
+			(as->as_nregions - i - 1) * sizeof(struct region));
+	as->as_nregions--;
+}
+
+
+/*
+ * If VADDR falls inside a region rather than at its start, cut the
+ * region in two there.
+ */
+static int
+as_split_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg, tail;
+	size_t headpages;
+	int result;
+
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL || rg->rg_vbase == vaddr) {
+		return 0;
+	}
+
+	headpages = (vaddr - rg->rg_vbase) / PAGE_SIZE;
+	tail = *rg;
+	tail.rg_vbase = vaddr;
+	tail.rg_npages = rg->rg_npages - headpages;
+	tail.rg_offset = rg->rg_offset + (off_t)headpages * PAGE_SIZE;
+
+	rg->rg_npages = headpages;
+	result = as_insert_region(as, &tail);
+	if (result) {
+		/* rg is still good; the array is only replaced on success. */
+		rg->rg_npages += tail.rg_npages;
+		return result;
+	}
+	if (tail.rg_vnode != NULL) {
+		VOP_INCREF(tail.rg_vnode);
+	}
+	return 0;
+}
+
+
+/*
+ * Free the pages mapped in [VADDR, END), skipping the 4MB stretches
+ * that have no second-level table.
+ */
+static void
+as_free_pages(struct addrspace *as, vaddr_t vaddr, vaddr_t end)
 {
-	if(r>0)
-		r=1;
-	if(w>0)
-		w=1;
-	if(x>0)
-		x=1;
-	int op = 0;
-	op=r+(w<<w)+(x<<2*x);
-
-	return op;
+	const vaddr_t span = PT_TABLE_SIZE * PAGE_SIZE;
+	uint32_t *pte;
+
+	while (vaddr < end) {
+		if (as->pt_dir[PT_DIR_INDEX(vaddr)] == NULL) {
+			vaddr = (vaddr + span) & ~(span - 1);
+			continue;
+		}
+		pte = pt_lookup(as, vaddr, false);
+		if (*pte != 0) {
+			vm_free_pte(pte);
+		}
+		vaddr += PAGE_SIZE;
+	}
 }
 
 
-vaddr_t as_set_rw_permission(vaddr_t *vadd)
+/*
+ * Pick a place for an NPAGES mapping: the highest gap below the stack
+ * that is big enough, as long as it is above the heap.
+ */
+int
+as_find_free(struct addrspace *as, size_t npages, vaddr_t *ret)
 {
-	int l3=(*vadd)&7;
-	int  b3=7;
-	int  lb=(l3<<3)|b3;
-	*vadd = (*vadd)|lb;
+	struct region *rg;
+	vaddr_t top, end, floor;
+	size_t sz = npages * PAGE_SIZE;
+	unsigned i;
+
+	floor = (as->hend + PAGE_SIZE - 1) & PAGE_FRAME;
+	top = as->as_stackvbase;
+
+	for (i = as->as_nregions; i > 0; i--) {
+		rg = &as->as_regions[i-1];
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (end <= top && top - end >= sz) {
+			break;
+		}
+		if (rg->rg_vbase < top) {
+			top = rg->rg_vbase;
+		}
+	}
 
-	return *vadd;
+	if (top < floor || top - floor < sz) {
+		return ENOMEM;
+	}
+	*ret = top - sz;
+	return 0;
 }
 
 
-vaddr_t as_reset_rw_permission(vaddr_t *vadd)
+/*
+ * True if the NPAGES pages at VADDR lie between the heap and the stack
+ * and no region overlaps them.
+ */
+bool
+as_range_free(struct addrspace *as, vaddr_t vaddr, size_t npages)
 {
-	int lb3=(*vadd)&0x3F;
-	lb3 = lb3>>3;
-	*vadd = (*vadd)&~0x3F;
-	*vadd=(*vadd)|lb3;
+	vaddr_t end = vaddr + npages * PAGE_SIZE;
+	vaddr_t floor = (as->hend + PAGE_SIZE - 1) & PAGE_FRAME;
+	unsigned i;
+
+	if (vaddr < floor || end < vaddr || end > as->as_stackvbase) {
+		return false;
+	}
+	for (i=0; i<as->as_nregions; i++) {
+		if (as->as_regions[i].rg_vbase >= end) {
+			break;
+		}
+		if (as->as_regions[i].rg_vbase +
+				as->as_regions[i].rg_npages * PAGE_SIZE > vaddr) {
+			return false;
+		}
+	}
+	return true;
+}
+
 
-	return *vadd;
+int
+as_define_mmap(struct addrspace *as, vaddr_t vaddr, size_t npages,
+		int flags, struct vnode *vn, off_t offset)
+{
+	struct region rg;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(npages > 0);
+
+	rg.rg_vbase = vaddr;
+	rg.rg_npages = npages;
+	rg.rg_flags = flags;
+	rg.rg_type = vn != NULL ? RG_FILE : RG_ANON;
+	rg.rg_vnode = vn;
+	rg.rg_offset = offset;
+
+	result = as_insert_region(as, &rg);
+	if (result) {
+		return result;
+	}
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	return 0;
 }
 
 
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct region *rg;
+	vaddr_t end = vaddr + npages * PAGE_SIZE;
+	unsigned i;
+	int result;
+
+	/* Check first, so that a refusal changes nothing. */
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (rg->rg_vbase >= end) {
+			break;
+		}
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > vaddr &&
+				rg->rg_type == RG_SEGMENT) {
+			return EINVAL;
+		}
+	}
+
+	result = as_split_region(as, vaddr);
+	if (result) {
+		return result;
+	}
+	result = as_split_region(as, end);
+	if (result) {
+		return result;
+	}
+
+	i = 0;
+	while (i < as->as_nregions) {
+		rg = &as->as_regions[i];
+		if (rg->rg_vbase < vaddr || rg->rg_vbase >= end) {
+			i++;
+			continue;
+		}
+		as_free_pages(as, rg->rg_vbase,
+				rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		as_remove_region(as, i);
+	}
+
+	/* Other cpus, or this one, may still have the pages loaded. */
+	vm_tlb_flush_as(as);
+	return 0;
+}
+
+
+int
+as_protect(struct addrspace *as, vaddr_t vaddr, size_t npages, int flags)
+{
+	const vaddr_t span = PT_TABLE_SIZE * PAGE_SIZE;
+	struct region *rg;
+	vaddr_t va, end = vaddr + npages * PAGE_SIZE;
+	unsigned i;
+	uint32_t *pte;
+	int result;
+
+	KASSERT((flags & ~(REGION_READ|REGION_WRITE|REGION_EXEC)) == 0);
+
+	/* Every page must be mapped by mmap. */
+	for (va = vaddr; va < end;
+			va = rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		rg = as_find_region(as, va);
+		if (rg == NULL || rg->rg_type == RG_SEGMENT) {
+			return ENOMEM;
+		}
+		if ((rg->rg_flags & REGION_SHARED) && (flags & REGION_WRITE)) {
+			return EACCES;
+		}
+	}
+
+	result = as_split_region(as, vaddr);
+	if (result) {
+		return result;
+	}
+	result = as_split_region(as, end);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (rg->rg_vbase >= vaddr && rg->rg_vbase < end) {
+			rg->rg_flags &= ~(REGION_READ|REGION_WRITE|REGION_EXEC);
+			rg->rg_flags |= flags;
+		}
+	}
+
+	/* Bring the pages already there in line. */
+	va = vaddr;
+	while (va < end) {
+		if (as->pt_dir[PT_DIR_INDEX(va)] == NULL) {
+			va = (va + span) & ~(span - 1);
+			continue;
+		}
+		pte = pt_lookup(as, va, false);
+		if (*pte != 0) {
+			vm_protect_pte(pte, flags);
+		}
+		va += PAGE_SIZE;
+	}
+
+	vm_tlb_flush_as(as);
+	return 0;
+}
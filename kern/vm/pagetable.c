@@ -0,0 +1,101 @@
+/*
+ * pagetable.c
+ *
+ *  Two-level page tables for user address spaces. See addrspace.h
+ *  for the layout.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+
+
+uint32_t *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	uint32_t *table;
+	int dir_index;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	dir_index = PT_DIR_INDEX(vaddr);
+	table = as->pt_dir[dir_index];
+
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_TABLE_SIZE * sizeof(uint32_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PT_TABLE_SIZE * sizeof(uint32_t));
+		as->pt_dir[dir_index] = table;
+	}
+
+	return &table[PT_TABLE_INDEX(vaddr)];
+}
+
+
+int
+pt_copy(struct addrspace *old, struct addrspace *new)
+{
+	uint32_t *oldtable, *newtable;
+	vaddr_t vaddr;
+	int result;
+
+	for (int i=0; i<PT_DIR_SIZE; i++) {
+		oldtable = old->pt_dir[i];
+		if (oldtable == NULL) {
+			continue;
+		}
+
+		newtable = kmalloc(PT_TABLE_SIZE * sizeof(uint32_t));
+		if (newtable == NULL) {
+			return ENOMEM;
+		}
+		bzero(newtable, PT_TABLE_SIZE * sizeof(uint32_t));
+		new->pt_dir[i] = newtable;
+
+		for (int j=0; j<PT_TABLE_SIZE; j++) {
+			if (oldtable[j] == 0) {
+				continue;
+			}
+
+			vaddr = ((vaddr_t)i << 22) | ((vaddr_t)j << 12);
+			result = vm_share_pte(old, vaddr,
+					&oldtable[j], &newtable[j]);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+void
+pt_destroy(struct addrspace *as)
+{
+	uint32_t *table;
+
+	for (int i=0; i<PT_DIR_SIZE; i++) {
+		table = as->pt_dir[i];
+		if (table == NULL) {
+			continue;
+		}
+
+		for (int j=0; j<PT_TABLE_SIZE; j++) {
+			if (table[j] != 0) {
+				vm_free_pte(&table[j]);
+			}
+		}
+
+		kfree(table);
+		as->pt_dir[i] = NULL;
+	}
+}
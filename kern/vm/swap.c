@@ -0,0 +1,127 @@
+/*
+ * swap.c
+ *
+ *  Backing store for evicted user pages. The swap disk is carved into
+ *  page-sized slots handed out from a bitmap.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+
+/* Raw device used for swap. The root filesystem lives on lhd0. */
+#define SWAP_DEVICE "lhd1raw:"
+
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map = NULL;
+static unsigned swap_nslots = 0;
+static struct spinlock swap_map_lock = SPINLOCK_INITIALIZER;
+
+bool swap_enabled = false;
+
+
+/*
+ * Open the swap disk and size the slot bitmap. If there is no swap
+ * disk the system runs without paging, as before.
+ */
+void swap_bootstrap(void){
+
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if(result){
+		kprintf("swap: %s: %s; paging disabled\n",
+				SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if(result){
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if(swap_map == NULL){
+		panic("swap: Out of memory for %u slot bitmap\n", swap_nslots);
+	}
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+	swap_enabled = true;
+}
+
+
+/*
+ * Reserve a free slot. Returns ENOSPC when swap is full.
+ */
+int swap_alloc_slot(unsigned *slot){
+
+	int result;
+
+	KASSERT(swap_enabled);
+
+	spinlock_acquire(&swap_map_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_map_lock);
+
+	return result;
+}
+
+
+void swap_free_slot(unsigned slot){
+
+	KASSERT(swap_enabled);
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_map_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_map_lock);
+}
+
+
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw){
+
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			(off_t)slot * PAGE_SIZE, rw);
+	if(rw == UIO_READ){
+		result = VOP_READ(swap_vnode, &ku);
+	}else{
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if(result == 0 && ku.uio_resid != 0){
+		result = EIO;
+	}
+
+	return result;
+}
+
+
+/* Copy the page at PADDR out to SLOT. */
+int swap_out(unsigned slot, paddr_t paddr){
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+
+/* Fill the page at PADDR from SLOT. */
+int swap_in(unsigned slot, paddr_t paddr){
+	return swap_io(slot, paddr, UIO_READ);
+}
@@ -6,28 +6,89 @@
 #include <thread.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <lockprof.h>
 
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+/* TLB misses served straight from the page table, and everything else. */
+static int vm_refillcounter = 0;
 static int vm_faultcounter = 0;
 
 int total_pages = 0;
 bool is_vm_bootstrapped = false;
 paddr_t coremap_base = 0;
 
-int as_get_permission(vaddr_t vadd);
-int validate_permission(int faulttype, int faultaddr);
+/*
+ * Buddy free lists, one per block order. Each holds the coremap index
+ * of the first free block of that order, or -1 if there are none.
+ */
+static int buddy_freelist[BUDDY_MAX_ORDER + 1];
+
+/* Pages moved between a cpu's page cache and the coremap at a time. */
+#define PAGECACHE_BATCH (CPU_PAGECACHE_MAX / 2)
+
+
+/*
+ * Pages zeroed ahead of time by idle cpus, linked through next_free.
+ * Freed pages are not scrubbed; zeroing happens here or, if the pool
+ * runs dry, in alloc_userpage outside coremap_lock.
+ */
+#define ZERO_POOL_TARGET 64
+#define ZERO_IDLE_BATCH 4
+static int zero_pool = -1;
+static int zero_pool_count = 0;
+
+/* Clock hand for picking page-out victims. */
+static int clock_hand = 0;
+
+/* Sleepers waiting for a PTE_PAGING entry to settle. */
+static struct wchan *paging_wchan;
+
+#define COREMAP_INDEX(paddr) ((int)(((paddr) - coremap_base) / PAGE_SIZE))
+
+int validate_permission(int faulttype, int flags);
 paddr_t get_physical_address(int code_index);
 int bp(void);
 
+static void buddy_push(int index, int order);
+static void buddy_unlink(int index);
+static int buddy_alloc(int npages);
+static void buddy_free_block(int index, int order);
+static void buddy_free_range(int index, int npages);
+
+static int pagecache_get(void);
+static void pagecache_put(int index);
+static int zero_pool_get(void);
+
+static void vm_wait_paging(void);
+static void vm_tlb_flush_local(void);
+static void vm_tlb_load(struct addrspace *as);
+static void vm_tlb_shootdown_as(struct addrspace *as, vaddr_t vaddr);
+static int vm_evict_page(void);
+static int vm_swapin(struct addrspace *as, vaddr_t vaddr, uint32_t *pte);
+static void vm_mark_dirty(uint32_t *pte);
+static int vm_cow_fault(struct addrspace *as, vaddr_t vaddr, uint32_t *pte);
+static uint32_t vm_tlbhi(vaddr_t vaddr);
+static bool vm_tlb_refill(struct addrspace *as, int faulttype,
+		vaddr_t vaddr);
+static int vm_fault_page(struct addrspace *as, int faulttype, vaddr_t vaddr,
+		uint32_t *pte, bool writable);
+static int vm_fill_page(struct addrspace *as, struct region *region,
+		vaddr_t vaddr, uint32_t *pte, bool writable);
+
 int aloc=0;
 
 void vm_bootstrap(void){
 
 	paddr_t start, end, free_addr;
+	int npages_all;
 
 	ram_getsize(&start, &end);
 
@@ -36,7 +97,9 @@ void vm_bootstrap(void){
 
 	coremap = (struct coremap_entry*) PADDR_TO_KVADDR(start);
 
-	free_addr = start + total_pages * sizeof(struct coremap_entry);
+	/* The coremap lives in front of the pages it describes. */
+	npages_all = (end - start) / PAGE_SIZE;
+	free_addr = start + npages_all * sizeof(struct coremap_entry);
 	free_addr = ROUNDUP(free_addr, PAGE_SIZE);
 
 	total_pages = (end - free_addr) / PAGE_SIZE;
@@ -46,22 +109,41 @@ void vm_bootstrap(void){
 	kprintf("\nFree:%d TotalPages:%d\n\n",free_addr,total_pages);
 
 	coremap_base = free_addr;
-	paddr_t addr;
 
 	spinlock_acquire(&coremap_lock);
 
-	for(int i=0; i< total_pages ; i++){
-		addr = coremap_base + i * PAGE_SIZE;
+	for(int i=0; i<=BUDDY_MAX_ORDER; i++){
+		buddy_freelist[i] = -1;
+	}
 
+	for(int i=0; i< total_pages ; i++){
 		coremap[i].vaddr = 0;
 		coremap[i].as = NULL;
 		coremap[i].npages = 1;
 		coremap[i].state = FREE;
+		coremap[i].refcount = 0;
+		coremap[i].swap_slot = -1;
+		coremap[i].referenced = false;
+		coremap[i].order = -1;
+		coremap[i].next_free = -1;
+		coremap[i].prev_free = -1;
 	}
 
+	/* Hand every page to the buddy lists in the largest aligned blocks. */
+	buddy_free_range(0, total_pages);
+
 	spinlock_release(&coremap_lock);
 
+	paging_wchan = wchan_create("paging");
+	if(paging_wchan == NULL){
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
 	is_vm_bootstrapped = true;
+
+#if OPT_LOCKPROF
+	lockprof_spinlock(&coremap_lock, "coremap_lock");
+#endif
 }
 
 
@@ -96,163 +178,455 @@ paddr_t getppages(int npages){
 
 
 paddr_t getppages_vm(int npages){
-	paddr_t addr;
-	bool found_pages = true;
-
-	spinlock_acquire(&coremap_lock);
-
-	for(int i=0; i<total_pages; i++){
-		found_pages = true;
+	paddr_t addr = 0;
+	int i;
 
-		for(int j=0; j<npages; j++){
-			if(coremap[i+j].state != FREE){
-				found_pages = false;
-				i = i+j;
-				break;
-			}
+	if(npages == 1){
+		i = pagecache_get();
+		if(i < 0){
+			/* Pre-zeroed pages are free memory too. */
+			i = zero_pool_get();
 		}
+	}else{
+		spinlock_acquire(&coremap_lock);
+		i = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+	}
 
-		if(found_pages){
-
-			addr = coremap_base + i * PAGE_SIZE;
+	/*
+	 * Out of memory: if we're allowed to sleep, page out a user page
+	 * to make room. Contiguous runs aren't worth chasing this way.
+	 */
+	while(i < 0 && npages == 1 && swap_enabled &&
+			!curthread->t_in_interrupt &&
+			curthread->t_iplhigh_count == 0){
+		if(vm_evict_page() != 0){
+			break;
+		}
+		i = pagecache_get();
+	}
 
-			coremap[i].vaddr = PADDR_TO_KVADDR(addr);
-			coremap[i].npages = npages;
-			for(int k=0; k<npages ; k++){
-				//bzero((void *)PADDR_TO_KVADDR(addr), PAGE_SIZE);
-				coremap[i++].state = FIXED;
-			}
+	if(i >= 0){
+		/* The pages are ours alone until they're freed. */
+		addr = coremap_base + i * PAGE_SIZE;
 
-			break;
+		coremap[i].vaddr = PADDR_TO_KVADDR(addr);
+		coremap[i].npages = npages;
+		for(int k=0; k<npages ; k++){
+			coremap[i+k].refcount = 1;
+			coremap[i+k].state = FIXED;
 		}
 	}
 
-	spinlock_release(&coremap_lock);
 	return addr;
 }
 
 
 void free_kpages(vaddr_t vaddr){
 
-	int npages_to_free = 0;
-	spinlock_acquire(&coremap_lock);
+	paddr_t paddr = vaddr - MIPS_KSEG0;
+	int i, npages_to_free;
 
-	int i;
-	for(i=0 ; i<total_pages ; i++){
-		if(vaddr == coremap[i].vaddr){
-			npages_to_free = coremap[i].npages;
-			break;
-		}
+	/* Pages stolen before vm_bootstrap are never returned. */
+	if(paddr < coremap_base){
+		return;
 	}
 
-	for(int j=0 ; j<npages_to_free ; j++){
-		coremap[i].vaddr = 0;
-		coremap[i].npages = 1;
-		coremap[i].state = FREE;
+	i = COREMAP_INDEX(paddr);
+	KASSERT(i < total_pages);
 
-		paddr_t addr = coremap_base + i * PAGE_SIZE;
-		bzero((void *)PADDR_TO_KVADDR(addr),PAGE_SIZE);
+	/* Kernel pages belong to whoever is freeing them; no lock needed. */
+	if(coremap[i].state != FIXED || coremap[i].vaddr != vaddr){
+		return;
+	}
 
-		i++;
+	npages_to_free = coremap[i].npages;
+
+	for(int j=0 ; j<npages_to_free ; j++){
+		coremap[i+j].vaddr = 0;
+		coremap[i+j].npages = 1;
+		coremap[i+j].state = FREE;
+		coremap[i+j].refcount = 0;
 	}
 
-	spinlock_release(&coremap_lock);
+	if(npages_to_free == 1){
+		pagecache_put(i);
+	}else{
+		spinlock_acquire(&coremap_lock);
+		buddy_free_range(i, npages_to_free);
+		spinlock_release(&coremap_lock);
+	}
 }
 
 
-paddr_t alloc_userpage(struct addrspace *as, vaddr_t vaddr){
+/*
+ * Allocate a page for VADDR in AS. If ZERO is set the page comes back
+ * zero-filled; otherwise the caller is about to overwrite all of it.
+ * Returns 0 if memory is exhausted and nothing can be paged out.
+ */
+paddr_t alloc_userpage(struct addrspace *as, vaddr_t vaddr, bool zero){
 	paddr_t addr = 0;
+	bool zeroed = false;
+	int i;
 
-	spinlock_acquire(&coremap_lock);
-
-	for(int i=0; i<total_pages; i++){
-		if(coremap[i].state == FREE){
+	for(;;){
+		i = -1;
+		if(zero){
+			i = zero_pool_get();
+			zeroed = i >= 0;
+		}
+		if(i < 0){
+			i = pagecache_get();
+		}
+		if(i < 0 && !zero){
+			i = zero_pool_get();
+		}
+		if(i >= 0){
+			/*
+			 * Nobody else touches a page fresh out of the cache.
+			 * The clock hand may look at it once the state says
+			 * DIRTY, but skips it until a PTE maps it.
+			 */
 			addr = coremap_base + i * PAGE_SIZE;
 			coremap[i].vaddr = vaddr;
 			coremap[i].as = as;
 			coremap[i].npages = 1;
+			coremap[i].refcount = 1;
+			coremap[i].swap_slot = -1;
+			if(zero && !zeroed){
+				bzero((void *)PADDR_TO_KVADDR(addr), PAGE_SIZE);
+			}
 			coremap[i].state = DIRTY;
-			//bzero((void *)PADDR_TO_KVADDR(addr),PAGE_SIZE);
+			break;
+		}
 
+		/* RAM is full; push somebody's page out to swap and retry. */
+		if(!swap_enabled || vm_evict_page() != 0){
 			break;
 		}
 	}
-	spinlock_release(&coremap_lock);
-	KASSERT(addr != 0);
+
 	return addr;
 }
 
 
-void free_userpage(vaddr_t vaddr){
+void free_userpage(paddr_t paddr){
+
+	int i;
 
-	bool isFreed = false;
+	KASSERT(paddr >= coremap_base);
+	i = COREMAP_INDEX(paddr);
+	KASSERT(i < total_pages);
 
 	spinlock_acquire(&coremap_lock);
 
-	int i;
-	for(i=0 ; i<total_pages ; i++){
-		if(vaddr == coremap[i].vaddr){
-			if(coremap[i].state == FIXED){
-				kprintf("\n Err** Cannot free (%d), It's a kernel page\n",vaddr);
-				spinlock_release(&coremap_lock);
-				return;
-			}else{
-				coremap[i].vaddr = 0;
-				coremap[i].as = NULL;
-				coremap[i].npages = 0;
-				coremap[i].state = FREE;
-				isFreed = true;
+	if(coremap[i].state == FIXED){
+		kprintf("\n Err** Cannot free (%d), It's a kernel page\n",paddr);
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	KASSERT(coremap[i].state != FREE);
+	KASSERT(coremap[i].refcount > 0);
+
+	/* Still mapped copy-on-write by somebody else. */
+	coremap[i].refcount--;
+	if(coremap[i].refcount > 0){
+		spinlock_release(&coremap_lock);
+		return;
+	}
 
-				paddr_t addr = coremap_base + i * PAGE_SIZE;
-				bzero((void *)PADDR_TO_KVADDR(addr),PAGE_SIZE);
+	if(coremap[i].swap_slot >= 0){
+		swap_free_slot(coremap[i].swap_slot);
+	}
 
-				break;
+	coremap[i].vaddr = 0;
+	coremap[i].as = NULL;
+	coremap[i].npages = 1;
+	coremap[i].state = FREE;
+	coremap[i].swap_slot = -1;
+	coremap[i].referenced = false;
+
+	spinlock_release(&coremap_lock);
+
+	pagecache_put(i);
+}
+
+
+/*
+ * Map the page behind OLDPTE into a second address space at NEWPTE
+ * (fork). Both entries end up read-only and copy-on-write. A page
+ * that is out on swap is brought back in first.
+ */
+int vm_share_pte(struct addrspace *as, vaddr_t vaddr,
+		uint32_t *oldpte, uint32_t *newpte){
+
+	int result, i;
+
+	spinlock_acquire(&coremap_lock);
+
+	for(;;){
+		if(*oldpte & PTE_PAGING){
+			vm_wait_paging();
+		}else if(*oldpte & PTE_SWAPPED){
+			result = vm_swapin(as, vaddr, oldpte);
+			if(result){
+				spinlock_release(&coremap_lock);
+				return result;
 			}
+		}else{
+			break;
 		}
 	}
 
+	if(*oldpte & TLBLO_VALID){
+		i = COREMAP_INDEX(*oldpte & TLBLO_PPAGE);
+		*oldpte &= ~TLBLO_DIRTY;
+		*oldpte |= PTE_COW;
+		*newpte = *oldpte;
+
+		/*
+		 * A shared page has no single owner, which also keeps the
+		 * clock hand off it. Whoever is left last adopts it again.
+		 */
+		coremap[i].refcount++;
+		coremap[i].as = NULL;
+	}
+
 	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+
+/*
+ * Tear down one page table entry, releasing its page or swap slot.
+ */
+void vm_free_pte(uint32_t *pte){
+
+	paddr_t paddr;
+
+	spinlock_acquire(&coremap_lock);
 
-	//KASSERT(isFreed == true);
-	//if(!isFreed)
-	//kprintf("\n Err** Virtual (%d) not found\n",vaddr);
+	while(*pte & PTE_PAGING){
+		vm_wait_paging();
+	}
+
+	if(*pte & PTE_SWAPPED){
+		swap_free_slot(PTE_SLOT(*pte));
+		*pte = 0;
+		spinlock_release(&coremap_lock);
+	}else if(*pte & TLBLO_VALID){
+		paddr = *pte & TLBLO_PPAGE;
+		*pte = 0;
+		spinlock_release(&coremap_lock);
+		free_userpage(paddr);
+	}else{
+		*pte = 0;
+		spinlock_release(&coremap_lock);
+	}
+}
+
+
+/*
+ * Bring a non-empty entry in line with new region permissions FLAGS
+ * (mprotect). Without REGION_WRITE the next write faults; with no
+ * access at all the entry is kept out of the TLB refill path. The
+ * caller flushes the TLB afterwards.
+ */
+void vm_protect_pte(uint32_t *pte, int flags){
+
+	spinlock_acquire(&coremap_lock);
+
+	while(*pte & PTE_PAGING){
+		vm_wait_paging();
+	}
+
+	if(!(flags & REGION_WRITE) && (*pte & TLBLO_VALID)){
+		*pte &= ~TLBLO_DIRTY;
+	}
+	if(flags & (REGION_READ | REGION_WRITE | REGION_EXEC)){
+		*pte &= ~PTE_NOACCESS;
+	}else if(*pte != 0){
+		*pte |= PTE_NOACCESS;
+	}
+
+	spinlock_release(&coremap_lock);
 }
 
 
 void vm_tlbshootdown_all(void){
-	int i, spl;
+	int spl;
+
+	/*
+	 * Start a new pid generation too, so that no address space can
+	 * come back to entries that might have survived elsewhere, and
+	 * reload whatever this cpu is running.
+	 */
 	spl = splhigh();
-	for (i=0; i<NUM_TLB; i++)
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	vm_tlb_flush_local();
+	curcpu->c_asidgen++;
+	curcpu->c_nextasid = 1;
+	vm_tlb_load(curthread->t_addrspace);
 	splx(spl);
 }
 
 
 void vm_tlbshootdown(const struct tlbshootdown * tlb){
-	(void)tlb;
+
+	struct addrspace *as = tlb->ts_addrspace;
+	struct cpu *c;
 	int i, spl;
+
 	spl = splhigh();
+	c = curcpu->c_self;
+
+	if(c->c_tlbas != as || tlb->ts_vaddr == TLBSHOOTDOWN_ASALL){
+		/* Forget the pid; whatever it tagged becomes unreachable. */
+		spinlock_acquire(&as->as_tlblock);
+		as->as_asid[c->c_number] = 0;
+		spinlock_release(&as->as_tlblock);
+
+		if(c->c_tlbas == as){
+			vm_tlb_load(curthread->t_addrspace);
+		}
+	}else{
+		i = tlb_probe(vm_tlbhi(tlb->ts_vaddr), 0);
+		if(i >= 0){
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tlb_setpid(c->c_tlbpid);
+		}
+	}
+
+	splx(spl);
+}
+
+
+/*
+ * Load AS's TLB pid on this cpu.
+ */
+void vm_tlb_activate(struct addrspace *as){
+	int spl;
+
+	spl = splhigh();
+	vm_tlb_load(as);
+	splx(spl);
+}
+
+
+/*
+ * Drop every TLB entry of AS, everywhere. The caller's own address
+ * space comes back with a fresh pid; cpus that had it loaded for
+ * nobody in particular let go of it.
+ */
+void vm_tlb_flush_as(struct addrspace *as){
+	vm_tlb_shootdown_as(as, TLBSHOOTDOWN_ASALL);
+}
+
+
+/* Write invalid entries over this cpu's whole TLB. Interrupts off. */
+static void vm_tlb_flush_local(void){
+	int i;
+
 	for (i=0; i<NUM_TLB; i++)
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	tlb_setpid(curcpu->c_tlbpid);
+}
+
+
+/*
+ * Make AS the address space loaded on this cpu, handing it a new pid
+ * if it has none in the current generation. Pid 0 is never handed out,
+ * and is what threads without an address space run with. When a cpu
+ * runs out of pids it flushes its TLB and starts a new generation,
+ * which makes every older assignment on that cpu stale.
+ *
+ * The cpu's bit in as_cpus is set while AS is loaded, so shootdowns
+ * know to interrupt it. Interrupts off.
+ */
+static void vm_tlb_load(struct addrspace *as){
+
+	struct cpu *c = curcpu->c_self;
+	struct addrspace *old = c->c_tlbas;
+	uint32_t bit = (uint32_t)1 << c->c_number;
+	uint32_t asid;
+
+	if(old != NULL && old != as){
+		spinlock_acquire(&old->as_tlblock);
+		old->as_cpus &= ~bit;
+		spinlock_release(&old->as_tlblock);
+	}
+
+	c->c_tlbas = as;
+	if(as == NULL){
+		c->c_tlbpid = 0;
+		tlb_setpid(0);
+		return;
+	}
+
+	spinlock_acquire(&as->as_tlblock);
+	as->as_cpus |= bit;
+	asid = as->as_asid[c->c_number];
+	if(asid / NUM_TLBPID != c->c_asidgen){
+		if(c->c_nextasid == NUM_TLBPID){
+			vm_tlb_flush_local();
+			c->c_asidgen++;
+			c->c_nextasid = 1;
+		}
+		asid = c->c_asidgen * NUM_TLBPID + c->c_nextasid++;
+		as->as_asid[c->c_number] = asid;
+	}
+	spinlock_release(&as->as_tlblock);
+
+	c->c_tlbpid = asid % NUM_TLBPID;
+	tlb_setpid(c->c_tlbpid);
+}
+
+
+/*
+ * Remove AS's entry for VADDR (or all of them, for TLBSHOOTDOWN_ASALL)
+ * from every TLB. Cpus that have AS loaded get a shootdown IPI, and we
+ * wait for them; the rest just forget AS's pid so the next load hands
+ * out a new one. Callers must not hold spinlocks.
+ */
+static void vm_tlb_shootdown_as(struct addrspace *as, vaddr_t vaddr){
+
+	struct tlbshootdown ts;
+	uint32_t cpus;
+	int i, spl;
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+
+	spl = splhigh();
+	spinlock_acquire(&as->as_tlblock);
+	cpus = as->as_cpus;
+	for(i=0; i<MAXCPUS; i++){
+		if(!(cpus & ((uint32_t)1 << i))){
+			as->as_asid[i] = 0;
+		}
+	}
+	spinlock_release(&as->as_tlblock);
 	splx(spl);
+
+	if(cpus != 0){
+		ipi_tlbshootdown_cpus(cpus, &ts);
+	}
 }
 
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	vaddr_t stackbase, stacktop;
 	paddr_t paddr;
 	uint32_t ehi, elo;
 
 	struct addrspace *as;
+	struct region *region;
+	bool writable = true;
 	int i, spl;
 
-	vm_faultcounter += 1;
 	faultaddress &= PAGE_FRAME;
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
-
 	as = curthread->t_addrspace;
 	if (as == NULL) {
 		/*
@@ -263,23 +637,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
+	if (vm_tlb_refill(as, faulttype, faultaddress)) {
+		return 0;
+	}
 
-	(void)faulttype;
-	vbase1 = as->as_vbase1;
-	int vbase1perm = vbase1&~PAGE_FRAME;
-	vbase1 = vbase1&PAGE_FRAME;
+	vm_faultcounter += 1;
 
-	vbase2 = as->as_vbase2;
-	int vbase2perm = vbase2&~PAGE_FRAME;
-	vbase2 = vbase2&PAGE_FRAME;
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_nregions != 0);
 
 	stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
@@ -292,14 +659,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	int error = 0;
 
-	if (faultaddress >= vbase1 && faultaddress <= vtop1) {
-		error = validate_permission(faulttype, vbase1perm);
-	}else if (faultaddress >= vbase2 && faultaddress <= vtop2) {
-		error = validate_permission(faulttype, vbase2perm);
+	region = as_find_region(as, faultaddress);
+
+	if (region != NULL) {
+		error = validate_permission(faulttype, region->rg_flags);
+		writable = (region->rg_flags &
+				(REGION_WRITE | REGION_LOADING)) != 0;
 	}else if (faultaddress >= stackbase && faultaddress <= stacktop) {
-		error = validate_permission(faulttype, 7);
+		error = validate_permission(faulttype, REGION_READ|REGION_WRITE);
 	}else if (faultaddress >= as->hstart && faultaddress <= as->hend) {
-		error = validate_permission(faulttype, 7);
+		error = validate_permission(faulttype, REGION_READ|REGION_WRITE);
 	}else {
 		//panic("\n**Err**Not in any region || Faultaddress: %d \n\n",faultaddress);
 		//return EFAULT;
@@ -309,79 +678,477 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return error;
 	}
 
-	// page is in pte
-	bool ispageInPte = false;
-	struct page_table_entry *ptehead = as->pte;
-	struct page_table_entry *prevpte = ptehead;
+	// look the page up, allocating it on first touch
+	uint32_t *pte = pt_lookup(as, faultaddress, true);
+	if(pte == NULL){
+		return ENOMEM;
+	}
 
-	while(ptehead!=NULL ){
-		if(faultaddress >= ptehead->va && faultaddress < (ptehead->va + PAGE_SIZE)){
-			paddr = (faultaddress - ptehead->va) + ptehead->pa;
-			ispageInPte = true;
-			break;
+	/* First touch of a file mapping; read the page in. */
+	if(region != NULL && region->rg_type == RG_FILE && *pte == 0){
+		error = vm_fill_page(as, region, faultaddress, pte, writable);
+		if(error){
+			return error;
 		}
-		prevpte = ptehead;
-		ptehead = ptehead->next;
 	}
 
-	if(!ispageInPte){
-
-		struct page_table_entry *newpte = kmalloc(sizeof(struct page_table_entry));
-		newpte->va = faultaddress;
-
-		paddr = alloc_userpage(as,faultaddress);
-
-		newpte->pa = paddr;
-		newpte->next = NULL;
+	/* coremap_lock also keeps interrupts off while we frob the TLB. */
+	spinlock_acquire(&coremap_lock);
 
-		if(as->pte==NULL){
-			as->pte = newpte;
-		}else{
-			prevpte->next = newpte;
-		}
+	error = vm_fault_page(as, faulttype, faultaddress, pte, writable);
+	if(error){
+		spinlock_release(&coremap_lock);
+		return error;
 	}
 
+	paddr = *pte & TLBLO_PPAGE;
+	coremap[COREMAP_INDEX(paddr)].referenced = true;
+
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	/*for (i=0; i<NUM_TLB; i++)
-	{
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}*/
+	ehi = vm_tlbhi(faultaddress);
+	elo = *pte & ~PTE_SWMASK;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 
-	i = tlb_probe((uint32_t)faultaddress, (uint32_t)paddr);
-	if(i!=-1){
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	i = tlb_probe(ehi, 0);
+	if(i >= 0){
 		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}else{
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_random(ehi, elo);
-		splx(spl);
+	}
+
+	splx(spl);
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+
+/*
+ * Read in the untouched pages of file mappings in VADDR..VADDR+LEN of
+ * the current address space. File I/O calls this on the user buffer
+ * first: once a device transfer has started, faulting a file page in
+ * would mean reading from a device that may be busy with that transfer
+ * and whose lock we hold. Other pages don't need it, since they come
+ * from memory or swap. Addresses outside any mapping are left for the
+ * transfer to fail on.
+ */
+int vm_prefault(vaddr_t vaddr, size_t len){
+
+	struct addrspace *as = curthread->t_addrspace;
+	struct region *region;
+	vaddr_t va, end;
+	uint32_t *pte;
+	int result;
+
+	if(as == NULL || len == 0 || vaddr >= USERSPACETOP){
 		return 0;
 	}
+	end = (len > USERSPACETOP - vaddr) ? USERSPACETOP : vaddr + len;
+
+	for(va = vaddr & PAGE_FRAME; va < end; va += PAGE_SIZE){
+		region = as_find_region(as, va);
+		if(region == NULL || region->rg_type != RG_FILE ||
+				validate_permission(VM_FAULT_READ,
+					region->rg_flags)){
+			continue;
+		}
+		pte = pt_lookup(as, va, true);
+		if(pte == NULL){
+			return ENOMEM;
+		}
+		if(*pte == 0){
+			result = vm_fill_page(as, region, va, pte,
+					(region->rg_flags &
+					 (REGION_WRITE | REGION_LOADING)) != 0);
+			if(result){
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * TLB miss fast path. If the page table already holds a resident
+ * mapping good enough for this access, load it into the TLB and skip
+ * the region checks and coremap_lock. Anything else (first touch,
+ * swapped or paging-in pages, copy-on-write and clean-page writes)
+ * goes the slow way.
+ *
+ * Page-out clears the PTE and then invalidates the TLB. Reading the
+ * PTE and writing the TLB with interrupts off keeps a stale entry from
+ * being loaded in between.
+ */
+static bool vm_tlb_refill(struct addrspace *as, int faulttype,
+		vaddr_t vaddr){
+
+	uint32_t *table, pte;
+	int spl;
+
+	if(faulttype == VM_FAULT_READONLY || vaddr >= USERSPACETOP){
+		return false;
+	}
+
+	table = as->pt_dir[PT_DIR_INDEX(vaddr)];
+	if(table == NULL){
+		return false;
+	}
 
-	// Jinghao comments
+	spl = splhigh();
+
+	pte = table[PT_TABLE_INDEX(vaddr)];
+	if(!(pte & TLBLO_VALID) ||
+			(pte & (PTE_SWAPPED | PTE_PAGING | PTE_NOACCESS)) ||
+			(faulttype == VM_FAULT_WRITE && !(pte & TLBLO_DIRTY))){
+		splx(spl);
+		return false;
+	}
+
+	/* Unlocked, like the TLB's own notion of use; it's only a hint. */
+	coremap[COREMAP_INDEX(pte & TLBLO_PPAGE)].referenced = true;
+
+	tlb_random(vm_tlbhi(vaddr), pte & ~PTE_SWMASK);
+	vm_refillcounter++;
 
 	splx(spl);
-	return EFAULT;
+	return true;
+}
+
+
+/*
+ * Make the page behind PTE resident and, for writes, writable. A new
+ * page is mapped writable only if WRITABLE, so that later writes to a
+ * read-only region still fault.
+ * Called and returns with coremap_lock held; may drop it to sleep.
+ */
+static int vm_fault_page(struct addrspace *as, int faulttype, vaddr_t vaddr,
+		uint32_t *pte, bool writable){
+
+	paddr_t paddr;
+	int result, i;
+
+	for(;;){
+		if(*pte & PTE_PAGING){
+			vm_wait_paging();
+		}else if(*pte & PTE_SWAPPED){
+			result = vm_swapin(as, vaddr, pte);
+			if(result){
+				return result;
+			}
+		}else if(!(*pte & TLBLO_VALID)){
+			spinlock_release(&coremap_lock);
+			paddr = alloc_userpage(as, vaddr, true);
+			spinlock_acquire(&coremap_lock);
+			if(paddr == 0){
+				return ENOMEM;
+			}
+			*pte = paddr | TLBLO_VALID |
+				(writable ? TLBLO_DIRTY : 0);
+			return 0;
+		}else{
+			break;
+		}
+	}
+
+	if(*pte & PTE_COW){
+		i = COREMAP_INDEX(*pte & TLBLO_PPAGE);
+		if(coremap[i].refcount == 1 && coremap[i].as == NULL){
+			coremap[i].as = as;
+			coremap[i].vaddr = vaddr;
+		}
+	}
+
+	/*
+	 * Writes to copy-on-write or clean pages. Doing it on the TLB
+	 * miss as well as the modify fault saves a second trap.
+	 */
+	if(faulttype != VM_FAULT_READ && !(*pte & TLBLO_DIRTY)){
+		if(*pte & PTE_COW){
+			return vm_cow_fault(as, vaddr, pte);
+		}
+		vm_mark_dirty(pte);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read the page of a file mapping at VADDR from the file, past EOF
+ * reading as zeros. The page is private from then on, so it pages to
+ * swap like any other. If somebody else filled the entry while we were
+ * reading, their page wins.
+ */
+static int vm_fill_page(struct addrspace *as, struct region *region,
+		vaddr_t vaddr, uint32_t *pte, bool writable){
+
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	off_t offset;
+	int result;
+
+	offset = region->rg_offset + (vaddr - region->rg_vbase);
+
+	paddr = alloc_userpage(as, vaddr, true);
+	if(paddr == 0){
+		return ENOMEM;
+	}
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			offset, UIO_READ);
+	result = VOP_READ(region->rg_vnode, &ku);
+	if(result){
+		free_userpage(paddr);
+		return result;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if(*pte != 0){
+		spinlock_release(&coremap_lock);
+		free_userpage(paddr);
+		return 0;
+	}
+	*pte = paddr | TLBLO_VALID | (writable ? TLBLO_DIRTY : 0);
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+
+/*
+ * First write to a copy-on-write page. Takes the page over if this is
+ * the last mapping, otherwise copies it.
+ */
+static int vm_cow_fault(struct addrspace *as, vaddr_t vaddr, uint32_t *pte){
+
+	paddr_t oldpaddr, newpaddr;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	oldpaddr = *pte & TLBLO_PPAGE;
+	i = COREMAP_INDEX(oldpaddr);
+
+	if(coremap[i].refcount == 1){
+		coremap[i].vaddr = vaddr;
+		coremap[i].as = as;
+		*pte &= ~PTE_COW;
+		vm_mark_dirty(pte);
+		return 0;
+	}
+
+	/* Hold an extra reference so the page can't be paged out under us. */
+	coremap[i].refcount++;
+	spinlock_release(&coremap_lock);
+
+	newpaddr = alloc_userpage(as, vaddr, false);
+	if(newpaddr == 0){
+		free_userpage(oldpaddr);
+		spinlock_acquire(&coremap_lock);
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpaddr),
+			(const void *)PADDR_TO_KVADDR(oldpaddr),
+			PAGE_SIZE);
+
+	/* Drop the extra reference and then this mapping's. */
+	free_userpage(oldpaddr);
+	free_userpage(oldpaddr);
+
+	spinlock_acquire(&coremap_lock);
+	*pte = newpaddr | TLBLO_DIRTY | TLBLO_VALID;
+	return 0;
+}
+
+
+/*
+ * A clean page is being written; its swap copy goes stale.
+ */
+static void vm_mark_dirty(uint32_t *pte){
+
+	int i = COREMAP_INDEX(*pte & TLBLO_PPAGE);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if(coremap[i].swap_slot >= 0){
+		swap_free_slot(coremap[i].swap_slot);
+		coremap[i].swap_slot = -1;
+	}
+	coremap[i].state = DIRTY;
+	*pte |= TLBLO_DIRTY;
+}
+
+
+/*
+ * Bring the page behind a PTE_SWAPPED entry back into memory. It
+ * comes back CLEAN and read-only, keeping its slot, so that if it is
+ * evicted again before being written it needn't be written out.
+ * Called and returns with coremap_lock held.
+ */
+static int vm_swapin(struct addrspace *as, vaddr_t vaddr, uint32_t *pte){
+
+	unsigned slot;
+	paddr_t paddr;
+	int result, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(*pte & PTE_SWAPPED);
+
+	slot = PTE_SLOT(*pte);
+	*pte |= PTE_PAGING;
+	spinlock_release(&coremap_lock);
+
+	paddr = alloc_userpage(as, vaddr, false);
+	result = paddr == 0 ? ENOMEM : swap_in(slot, paddr);
+
+	if(result){
+		if(paddr != 0){
+			free_userpage(paddr);
+		}
+		spinlock_acquire(&coremap_lock);
+		*pte &= ~PTE_PAGING;
+		wchan_wakeall(paging_wchan);
+		return result;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	i = COREMAP_INDEX(paddr);
+	coremap[i].state = CLEAN;
+	coremap[i].swap_slot = slot;
+	*pte = paddr | TLBLO_VALID | (*pte & PTE_NOACCESS);
+
+	wchan_wakeall(paging_wchan);
+	return 0;
+}
+
+
+/*
+ * Pick a victim with the clock algorithm and push it out to swap.
+ * Only pages mapped by exactly one page table entry are considered.
+ * Returns 0 if a page was freed.
+ */
+static int vm_evict_page(void){
+
+	struct addrspace *as = NULL;
+	vaddr_t vaddr = 0;
+	paddr_t paddr = 0;
+	uint32_t *pte = NULL;
+	uint32_t oldpte;
+	unsigned slot;
+	bool wasdirty;
+	int i, n, victim = -1;
+	int result;
+
+	spinlock_acquire(&coremap_lock);
+
+	for(n=0; n<2*total_pages; n++){
+		i = clock_hand;
+		clock_hand = (clock_hand + 1) % total_pages;
+
+		if(coremap[i].state != DIRTY && coremap[i].state != CLEAN){
+			continue;
+		}
+		if(coremap[i].refcount != 1 || coremap[i].as == NULL){
+			continue;
+		}
+		if(coremap[i].referenced){
+			coremap[i].referenced = false;
+			continue;
+		}
+
+		/* Skip pages whose mapping isn't in place (yet). */
+		paddr = coremap_base + i * PAGE_SIZE;
+		pte = pt_lookup(coremap[i].as, coremap[i].vaddr, false);
+		if(pte == NULL || !(*pte & TLBLO_VALID) ||
+				(*pte & TLBLO_PPAGE) != paddr){
+			continue;
+		}
+
+		victim = i;
+		break;
+	}
+
+	if(victim < 0){
+		spinlock_release(&coremap_lock);
+		return ENOMEM;
+	}
+
+	as = coremap[victim].as;
+	vaddr = coremap[victim].vaddr;
+	wasdirty = (coremap[victim].state == DIRTY);
+	slot = coremap[victim].swap_slot;
+
+	coremap[victim].state = BUSY;
+	oldpte = *pte;
+	*pte = paddr | PTE_PAGING;
+
+	spinlock_release(&coremap_lock);
+
+	vm_tlb_shootdown_as(as, vaddr);
+
+	if(wasdirty){
+		result = swap_alloc_slot(&slot);
+		if(result == 0){
+			result = swap_out(slot, paddr);
+			if(result){
+				swap_free_slot(slot);
+			}
+		}
+		if(result){
+			spinlock_acquire(&coremap_lock);
+			coremap[victim].state = DIRTY;
+			*pte = oldpte;
+			wchan_wakeall(paging_wchan);
+			spinlock_release(&coremap_lock);
+			return result;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	*pte = PTE_MKSWAP(slot) | (oldpte & PTE_NOACCESS);
+
+	coremap[victim].vaddr = 0;
+	coremap[victim].as = NULL;
+	coremap[victim].npages = 1;
+	coremap[victim].state = FREE;
+	coremap[victim].refcount = 0;
+	coremap[victim].swap_slot = -1;
+	coremap[victim].referenced = false;
+
+	wchan_wakeall(paging_wchan);
+	spinlock_release(&coremap_lock);
+
+	/* Most likely this cpu wants the page right back. */
+	pagecache_put(victim);
+
+	return 0;
+}
+
+
+/*
+ * Sleep until some entry in transit to or from swap settles. Called
+ * and returns with coremap_lock held; callers recheck their entry.
+ */
+static void vm_wait_paging(void){
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	wchan_lock(paging_wchan);
+	spinlock_release(&coremap_lock);
+	wchan_sleep(paging_wchan);
+	spinlock_acquire(&coremap_lock);
+}
+
+
+/* Entryhi for VADDR under this cpu's current pid. Interrupts off. */
+static uint32_t vm_tlbhi(vaddr_t vaddr){
+	return (vaddr & TLBHI_VPAGE) | (curcpu->c_tlbpid << TLBHI_PIDSHIFT);
 }
 
 
@@ -402,10 +1169,9 @@ paddr_t get_physical_address(int code_index)
 }
 
 
-int validate_permission(int faulttype, int  permission)
+int validate_permission(int faulttype, int flags)
 {
-	//int isReadable = permission&1;
-	int isWriteable = permission&2;
+	int isWriteable = flags & (REGION_WRITE|REGION_LOADING);
 
 	switch (faulttype)
 	{
@@ -417,15 +1183,306 @@ int validate_permission(int faulttype, int  permission)
 		if(!isWriteable)
 			return EINVAL;
 		break;
+	case VM_FAULT_READ:
+		/* The TLB can't tell reads from fetches; only PROT_NONE stops them. */
+		if(!(flags & (REGION_READ|REGION_WRITE|REGION_EXEC|REGION_LOADING)))
+			return EINVAL;
+		break;
 	}
 	return 0;
 }
 
 
-int as_get_permission(vaddr_t vadd)
+// Buddy allocator. All of these expect coremap_lock to be held.
+
+
+static void buddy_push(int index, int order)
+{
+	coremap[index].order = order;
+	coremap[index].prev_free = -1;
+	coremap[index].next_free = buddy_freelist[order];
+	if(buddy_freelist[order] >= 0){
+		coremap[buddy_freelist[order]].prev_free = index;
+	}
+	buddy_freelist[order] = index;
+}
+
+
+static void buddy_unlink(int index)
 {
-	int op = 0;
-	op=vadd&7;
-	return op;
+	int order = coremap[index].order;
+	int prev = coremap[index].prev_free;
+	int next = coremap[index].next_free;
+
+	KASSERT(order >= 0);
+
+	if(prev >= 0){
+		coremap[prev].next_free = next;
+	}else{
+		buddy_freelist[order] = next;
+	}
+	if(next >= 0){
+		coremap[next].prev_free = prev;
+	}
+
+	coremap[index].order = -1;
+	coremap[index].next_free = -1;
+	coremap[index].prev_free = -1;
 }
 
+
+/*
+ * Take NPAGES contiguous pages off the free lists and return the
+ * coremap index of the first one, or -1 if no run is available. The
+ * smallest block that fits is split down; the unused tail of the block
+ * goes straight back onto the free lists.
+ */
+static int buddy_alloc(int npages)
+{
+	int order, o, index;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if(npages <= 0){
+		return -1;
+	}
+
+	order = 0;
+	while((1 << order) < npages){
+		order++;
+		if(order > BUDDY_MAX_ORDER){
+			return -1;
+		}
+	}
+
+	for(o=order; o<=BUDDY_MAX_ORDER; o++){
+		if(buddy_freelist[o] >= 0){
+			break;
+		}
+	}
+	if(o > BUDDY_MAX_ORDER){
+		return -1;
+	}
+
+	index = buddy_freelist[o];
+	buddy_unlink(index);
+
+	/* Split off upper halves until the block is the right order. */
+	while(o > order){
+		o--;
+		buddy_push(index + (1 << o), o);
+	}
+
+	if(npages < (1 << order)){
+		buddy_free_range(index + npages, (1 << order) - npages);
+	}
+
+	return index;
+}
+
+
+/*
+ * Return one aligned block of 1 << ORDER pages, merging it with its
+ * buddy for as long as the buddy is free and of the same order.
+ */
+static void buddy_free_block(int index, int order)
+{
+	int buddy;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	while(order < BUDDY_MAX_ORDER){
+		buddy = index ^ (1 << order);
+		if(buddy + (1 << order) > total_pages ||
+				coremap[buddy].order != order){
+			break;
+		}
+		buddy_unlink(buddy);
+		if(buddy < index){
+			index = buddy;
+		}
+		order++;
+	}
+
+	buddy_push(index, order);
+}
+
+
+/*
+ * Return an arbitrary run of pages by splitting it into the largest
+ * naturally aligned blocks it contains.
+ */
+static void buddy_free_range(int index, int npages)
+{
+	int order;
+
+	while(npages > 0){
+		order = 0;
+		while(order < BUDDY_MAX_ORDER &&
+				(index & ((1 << (order + 1)) - 1)) == 0 &&
+				(1 << (order + 1)) <= npages){
+			order++;
+		}
+		buddy_free_block(index, order);
+		index += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+
+// Per-cpu page caches. Only the owning cpu touches its cache, with
+// interrupts off so it can't be migrated in the middle.
+
+
+/*
+ * Take a free page from this cpu's cache, refilling it from the
+ * buddy lists a batch at a time. Returns -1 if memory is exhausted.
+ */
+static int pagecache_get(void)
+{
+	struct cpu *c;
+	int index = -1;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if(c->c_npagecache == 0){
+		spinlock_acquire(&coremap_lock);
+		while(c->c_npagecache < PAGECACHE_BATCH){
+			index = buddy_alloc(1);
+			if(index < 0){
+				break;
+			}
+			c->c_pagecache[c->c_npagecache++] = index;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	if(c->c_npagecache > 0){
+		index = c->c_pagecache[--c->c_npagecache];
+	}
+
+	splx(spl);
+	return index;
+}
+
+
+/*
+ * Give a FREE page to this cpu's cache, draining half of the cache
+ * back to the buddy lists if it is full.
+ */
+static void pagecache_put(int index)
+{
+	struct cpu *c;
+	int spl;
+
+	KASSERT(coremap[index].state == FREE);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if(c->c_npagecache == CPU_PAGECACHE_MAX){
+		spinlock_acquire(&coremap_lock);
+		while(c->c_npagecache > CPU_PAGECACHE_MAX - PAGECACHE_BATCH){
+			buddy_free_block(c->c_pagecache[--c->c_npagecache], 0);
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	c->c_pagecache[c->c_npagecache++] = index;
+
+	splx(spl);
+}
+
+
+// Pre-zeroed page pool.
+
+
+/* Take a page from the zeroed pool, or -1 if it is empty. */
+static int zero_pool_get(void)
+{
+	int index;
+
+	spinlock_acquire(&coremap_lock);
+	index = zero_pool;
+	if(index >= 0){
+		zero_pool = coremap[index].next_free;
+		zero_pool_count--;
+	}
+	spinlock_release(&coremap_lock);
+
+	return index;
+}
+
+
+/*
+ * Called from the idle loop with interrupts off. Zero a few free pages
+ * into the pool. Returns true if it did any work, in which case the
+ * caller should look at its run queue again before idling.
+ */
+bool vm_zero_idle(void)
+{
+	int index, n;
+
+	if(!is_vm_bootstrapped){
+		return false;
+	}
+
+	for(n=0; n<ZERO_IDLE_BATCH; n++){
+		/* Unlocked peek; losing the race just overfills a little. */
+		if(zero_pool_count >= ZERO_POOL_TARGET){
+			break;
+		}
+		index = pagecache_get();
+		if(index < 0){
+			break;
+		}
+
+		bzero((void *)PADDR_TO_KVADDR(coremap_base + index * PAGE_SIZE),
+				PAGE_SIZE);
+
+		spinlock_acquire(&coremap_lock);
+		coremap[index].next_free = zero_pool;
+		zero_pool = index;
+		zero_pool_count++;
+		spinlock_release(&coremap_lock);
+	}
+
+	return n > 0;
+}
+
+
+void vm_printstats(void)
+{
+	unsigned nfree = 0;
+#if OPT_LOCKPROF
+	struct lockprof lp;
+#endif
+
+	spinlock_acquire(&coremap_lock);
+	for(int order=0; order<=BUDDY_MAX_ORDER; order++){
+		for(int i=buddy_freelist[order]; i>=0; i=coremap[i].next_free){
+			nfree += 1 << order;
+		}
+	}
+#if OPT_LOCKPROF
+	/* Taking the lock was counted too; that's fine for a report. */
+	if(coremap_lock.lk_prof != NULL){
+		lp = *coremap_lock.lk_prof;
+	}else{
+		bzero(&lp, sizeof(lp));
+	}
+#endif
+	spinlock_release(&coremap_lock);
+
+	kprintf("VM: %d pages, %u free in coremap, %d zeroed\n",
+			total_pages, nfree, zero_pool_count);
+	kprintf("VM: %d TLB refills, %d page faults\n",
+			vm_refillcounter, vm_faultcounter);
+#if OPT_LOCKPROF
+	kprintf("coremap_lock: %u acquires, %u contended, %llu ns waiting\n",
+			lp.lp_acquires, lp.lp_contended,
+			(unsigned long long)lp.lp_wait_nsecs);
+#endif
+}
@@ -0,0 +1,27 @@
+/*
+ * sys/mman.h
+ *
+ *  Memory mapping calls.
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+#include <kern/mman.h>
+
+/* Returned by mmap on failure. */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap maps LEN bytes of the file open on FD, starting at OFFSET (a
+ * multiple of the page size), or zero-filled memory with MAP_ANON.
+ * Writable MAP_SHARED mappings are not supported; writes to a
+ * MAP_PRIVATE file mapping are never seen by the file.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+
+
+#endif /* _SYS_MMAN_H_ */
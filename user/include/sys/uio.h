@@ -0,0 +1,19 @@
+/*
+ * sys/uio.h
+ *
+ *  Scatter/gather I/O. Each call moves the buffers in order, as one
+ *  read or write at the file offset, and returns the total moved.
+ *  At most IOV_MAX buffers may be passed.
+ */
+
+#ifndef _SYS_UIO_H_
+#define _SYS_UIO_H_
+
+#include <sys/types.h>
+#include <kern/iovec.h>
+
+int readv(int filehandle, const struct iovec *iov, int iovcnt);
+int writev(int filehandle, const struct iovec *iov, int iovcnt);
+
+
+#endif /* _SYS_UIO_H_ */
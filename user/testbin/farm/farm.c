@@ -50,14 +50,15 @@ static
 void
 spawnv(const char *prog, char **argv)
 {
-	int pid = fork();
+	int pid = vfork();
 	switch (pid) {
 	    case -1:
-		err(1, "fork");
+		err(1, "vfork");
 	    case 0:
-		/* child */
+		/* child, in our memory: _exit rather than exit */
 		execv(prog, argv);
-		err(1, "%s", prog);
+		warn("%s", prog);
+		_exit(1);
 	    default:
 		/* parent */
 		pids[npids++] = pid;
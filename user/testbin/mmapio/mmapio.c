@@ -0,0 +1,161 @@
+/*
+ * mmapio.c
+ *
+ *  File I/O through file mappings. write() from an untouched mapping
+ *  of one file into another, then read() that file back into a fresh
+ *  untouched mapping, and check the data. The first touch of each
+ *  mapped page happens inside the transfer, which used to hang on
+ *  the device lock.
+ *
+ *  Usage: mmapio [directory]; the files are created there (default
+ *  the current directory) and removed afterwards.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#define PAGESIZE	4096
+#define NPAGES		5
+#define FILESIZE	(NPAGES * PAGESIZE - 100)	/* ends mid-page */
+
+static char pattern[FILESIZE];
+static char check[FILESIZE];
+static char srcname[128];
+static char dstname[128];
+
+static
+void
+fill(void)
+{
+	int i;
+
+	for (i=0; i<FILESIZE; i++) {
+		pattern[i] = (char)(i * 7 + i / PAGESIZE);
+	}
+}
+
+static
+void
+makefile(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	if (write(fd, pattern, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", name);
+	}
+	close(fd);
+}
+
+static
+void
+verify(const char *what, const char *buf)
+{
+	int i;
+
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != pattern[i]) {
+			errx(1, "%s: byte %d is %d, should be %d", what, i,
+			     buf[i], pattern[i]);
+		}
+	}
+}
+
+static
+char *
+mapfile(const char *name, int prot, int *fdret)
+{
+	void *p;
+	int fd;
+
+	fd = open(name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	p = mmap(NULL, NPAGES * PAGESIZE, prot, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", name);
+	}
+	*fdret = fd;
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *dir = ".";
+	char *map;
+	int mfd, fd, r;
+
+	if (argc > 2) {
+		errx(1, "Usage: mmapio [directory]");
+	}
+	if (argc == 2) {
+		dir = argv[1];
+	}
+	snprintf(srcname, sizeof(srcname), "%s/mmapio.src", dir);
+	snprintf(dstname, sizeof(dstname), "%s/mmapio.dst", dir);
+
+	fill();
+	makefile(srcname);
+
+	/* write() straight out of the mapping */
+	map = mapfile(srcname, PROT_READ, &mfd);
+	fd = open(dstname, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", dstname);
+	}
+	r = write(fd, map, FILESIZE);
+	if (r != FILESIZE) {
+		err(1, "%s: write from mapping (%d)", dstname, r);
+	}
+	close(fd);
+	if (munmap(map, NPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	close(mfd);
+
+	fd = open(dstname, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", dstname);
+	}
+	if (read(fd, check, FILESIZE) != FILESIZE) {
+		err(1, "%s: read", dstname);
+	}
+	close(fd);
+	verify("write from mapping", check);
+	printf("mmapio: write from mapping ok\n");
+
+	/*
+	 * read() straight into a fresh private mapping, of a source file
+	 * now all zeros so the data can only have come from the read.
+	 */
+	memset(pattern, 0, sizeof(pattern));
+	makefile(srcname);
+	fill();
+	map = mapfile(srcname, PROT_READ|PROT_WRITE, &mfd);
+	fd = open(dstname, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", dstname);
+	}
+	r = read(fd, map, FILESIZE);
+	if (r != FILESIZE) {
+		err(1, "%s: read into mapping (%d)", dstname, r);
+	}
+	close(fd);
+	verify("read into mapping", map);
+	munmap(map, NPAGES * PAGESIZE);
+	close(mfd);
+	printf("mmapio: read into mapping ok\n");
+
+	remove(srcname);
+	remove(dstname);
+	printf("mmapio: passed\n");
+	return 0;
+}
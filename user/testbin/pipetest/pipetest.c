@@ -0,0 +1,116 @@
+/*
+ * pipetest.c
+ *
+ *  A two-process pipeline. The parent forks a reader, closes its own
+ *  read end while the reader is (likely) blocked on the empty pipe,
+ *  then writes several buffers' worth of data and closes. The reader
+ *  checks the data and that it sees EOF, and exits with the result.
+ *  Finally a write to a second pipe whose read end is closed must
+ *  fail with EPIPE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define TOTAL	20000		/* several pipe buffers */
+#define CHUNK	700		/* doesn't divide the buffer size */
+
+static char buf[CHUNK];
+
+static
+char
+byteat(int pos)
+{
+	return (char)(pos * 13 + pos / 256);
+}
+
+static
+int
+reader(int fd)
+{
+	int pos = 0, r, i;
+
+	for (;;) {
+		r = read(fd, buf, sizeof(buf));
+		if (r < 0) {
+			warn("reader: read");
+			return 1;
+		}
+		if (r == 0) {
+			break;
+		}
+		for (i=0; i<r; i++, pos++) {
+			if (buf[i] != byteat(pos)) {
+				warnx("reader: byte %d is wrong", pos);
+				return 1;
+			}
+		}
+	}
+	if (pos != TOTAL) {
+		warnx("reader: got %d bytes, expected %d", pos, TOTAL);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	int fds[2];
+	int pid, status, pos, len, i, r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[1]);
+		_exit(reader(fds[0]));
+	}
+
+	/* This used to hang while the child was blocked reading. */
+	close(fds[0]);
+
+	for (pos = 0; pos < TOTAL; pos += len) {
+		len = TOTAL - pos < CHUNK ? TOTAL - pos : CHUNK;
+		for (i=0; i<len; i++) {
+			buf[i] = byteat(pos + i);
+		}
+		r = write(fds[1], buf, len);
+		if (r != len) {
+			err(1, "write at %d (%d)", pos, r);
+		}
+	}
+
+	/* The reader sees EOF once this, the last write end, is gone. */
+	close(fds[1]);
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "reader failed");
+	}
+
+	/* A pipe nobody can read from */
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	r = write(fds[1], buf, 1);
+	if (r >= 0 || errno != EPIPE) {
+		errx(1, "write with no reader: got %d, expected EPIPE", r);
+	}
+	close(fds[1]);
+
+	printf("pipetest: passed\n");
+	return 0;
+}